@@ -19,7 +19,9 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/tick.h>
 #include <linux/timer.h>
@@ -33,6 +35,7 @@ static atomic_t active_count = ATOMIC_INIT(0);
 
 struct cpufreq_interactive_cpuinfo {
 	struct timer_list cpu_timer;
+	struct timer_list cpu_slack_timer;
 	int timer_idlecancel;
 	u64 time_in_idle;
 	u64 idle_exit_time;
@@ -43,6 +46,7 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_policy *policy;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
+	spinlock_t target_freq_lock;
 	int governor_enabled;
 };
 
@@ -57,16 +61,59 @@ static spinlock_t up_cpumask_lock;
 static cpumask_t down_cpumask;
 static spinlock_t down_cpumask_lock;
 
-/* Go to max speed when CPU load at or above this value. */
+/* Go to hispeed_freq when CPU load at or above this value. */
 #define DEFAULT_GO_MAXSPEED_LOAD 85
 static unsigned long go_maxspeed_load;
 
+/*
+ * Target load per speed, as "load speed:load speed:load ...": the load
+ * applies from its speed up to the next one.  The governor picks the
+ * lowest speed that keeps the CPU load at or under its target.
+ */
+#define DEFAULT_TARGET_LOAD 90
+static unsigned int default_target_loads[] = {DEFAULT_TARGET_LOAD};
+static unsigned int *target_loads = default_target_loads;
+static int ntarget_loads = ARRAY_SIZE(default_target_loads);
+static DEFINE_SPINLOCK(target_loads_lock);
+
+/*
+ * The sampling timer is deferrable, an idle CPU above min speed is woken
+ * after this many uS to re-evaluate its speed.  -1 leaves it at speed
+ * until something else wakes it.
+ */
+#define DEFAULT_TIMER_SLACK 80000
+static long timer_slack = DEFAULT_TIMER_SLACK;
+
 /*
  * The minimum amount of time to spend at a frequency before we can ramp down.
  */
 #define DEFAULT_MIN_SAMPLE_TIME 80000;
 static unsigned long min_sample_time;
 
+/*
+ * Speed to jump to on input events and boostpulse writes, 0 means the
+ * policy max.
+ */
+static unsigned long hispeed_freq;
+
+/* How long (uS) a boost holds hispeed_freq before load decides again. */
+#define DEFAULT_BOOSTPULSE_DURATION 80000
+static unsigned long boostpulse_duration;
+static unsigned long boostpulse_endtime;
+
+/*
+ * Set while a pulse holds hispeed_freq, the timer clears it once the pulse
+ * ends so a stale boostpulse_endtime is never compared across a jiffies
+ * wrap.  CPUs still to be raised for the pulse are in boost_cpumask.  Both
+ * are protected by up_cpumask_lock.
+ */
+static int boostpulse_active;
+static cpumask_t boost_cpumask;
+
+/* Boost on touch and key events. */
+static unsigned long input_boost = 1;
+static int input_handler_registered;
+
 #define DEBUG 0
 #define BUFSZ 128
 
@@ -167,6 +214,115 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+static unsigned int cpufreq_interactive_hispeed(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	if (!hispeed_freq || hispeed_freq > pcpu->policy->max)
+		return pcpu->policy->max;
+
+	return hispeed_freq;
+}
+
+/* Whether a boost pulse holds hispeed_freq, ends the pulse once expired. */
+static int cpufreq_interactive_boosted(void)
+{
+	unsigned long flags;
+	int boosted;
+
+	if (!boostpulse_active)
+		return 0;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	boosted = boostpulse_active &&
+		time_before(jiffies, boostpulse_endtime);
+	boostpulse_active = boosted;
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	return boosted;
+}
+
+static unsigned int freq_to_targetload(unsigned int freq)
+{
+	int i;
+	unsigned int ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+
+	for (i = 0; i < ntarget_loads - 1 && freq >= target_loads[i + 1];
+	     i += 2)
+		;
+
+	ret = target_loads[i];
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return ret;
+}
+
+/*
+ * Lowest table speed at which loadadjfreq, the load times the speed it
+ * was measured at, stays at or under the target load for that speed.
+ * The target load differs between speeds, so search until the choice
+ * settles, narrowing down [freqmin, freqmax) in case it oscillates.
+ */
+static unsigned int cpufreq_interactive_choose_freq(
+	struct cpufreq_interactive_cpuinfo *pcpu, unsigned int loadadjfreq)
+{
+	unsigned int freq = pcpu->policy->cur;
+	unsigned int prevfreq, freqmin, freqmax;
+	unsigned int index;
+
+	freqmin = 0;
+	freqmax = UINT_MAX;
+
+	do {
+		prevfreq = freq;
+
+		if (cpufreq_frequency_table_target(pcpu->policy,
+				pcpu->freq_table,
+				loadadjfreq / freq_to_targetload(freq),
+				CPUFREQ_RELATION_L, &index))
+			break;
+
+		freq = pcpu->freq_table[index].frequency;
+
+		if (freq > prevfreq) {
+			/* prevfreq is too slow */
+			freqmin = prevfreq;
+
+			if (freq >= freqmax) {
+				if (cpufreq_frequency_table_target(pcpu->policy,
+						pcpu->freq_table, freqmax - 1,
+						CPUFREQ_RELATION_H, &index))
+					break;
+
+				freq = pcpu->freq_table[index].frequency;
+
+				/* Nothing between too slow and fast enough */
+				if (freq == freqmin) {
+					freq = freqmax;
+					break;
+				}
+			}
+		} else if (freq < prevfreq) {
+			/* prevfreq is fast enough */
+			freqmax = prevfreq;
+
+			if (freq <= freqmin) {
+				if (cpufreq_frequency_table_target(pcpu->policy,
+						pcpu->freq_table, freqmin + 1,
+						CPUFREQ_RELATION_L, &index))
+					break;
+
+				freq = pcpu->freq_table[index].frequency;
+
+				if (freq == freqmax)
+					break;
+			}
+		}
+	} while (freq != prevfreq);
+
+	return freq;
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -250,10 +406,20 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
-	if (cpu_load >= go_maxspeed_load)
-		new_freq = pcpu->policy->max;
-	else
-		new_freq = pcpu->policy->max * cpu_load / 100;
+	new_freq = cpufreq_interactive_choose_freq(pcpu,
+					cpu_load * pcpu->policy->cur);
+
+	if (cpu_load >= go_maxspeed_load &&
+	    new_freq < cpufreq_interactive_hispeed(pcpu))
+		new_freq = cpufreq_interactive_hispeed(pcpu);
+
+	/*
+	 * Hold the boost speed until the pulse ends, ramp-down after that
+	 * still waits for min_sample_time since the boost.
+	 */
+	if (cpufreq_interactive_boosted() &&
+	    new_freq < cpufreq_interactive_hispeed(pcpu))
+		new_freq = cpufreq_interactive_hispeed(pcpu);
 
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
@@ -264,8 +430,12 @@ static void cpufreq_interactive_timer(unsigned long data)
 
 	new_freq = pcpu->freq_table[index].frequency;
 
+	/* The up task may raise target_freq for a boost pulse meanwhile. */
+	spin_lock_irqsave(&pcpu->target_freq_lock, flags);
+
 	if (pcpu->target_freq == new_freq)
 	{
+		spin_unlock_irqrestore(&pcpu->target_freq_lock, flags);
 		dbgpr("timer %d: load=%d, already at %d\n", (int) data, cpu_load, new_freq);
 		goto rearm_if_notmax;
 	}
@@ -277,6 +447,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (new_freq < pcpu->target_freq) {
 		if (cputime64_sub(pcpu->timer_run_time, pcpu->freq_change_time) <
 		    min_sample_time) {
+			spin_unlock_irqrestore(&pcpu->target_freq_lock, flags);
 			dbgpr("timer %d: load=%d cur=%d tgt=%d not yet\n", (int) data, cpu_load, pcpu->target_freq, new_freq);
 			goto rearm;
 		}
@@ -286,12 +457,14 @@ static void cpufreq_interactive_timer(unsigned long data)
 
 	if (new_freq < pcpu->target_freq) {
 		pcpu->target_freq = new_freq;
+		spin_unlock_irqrestore(&pcpu->target_freq_lock, flags);
 		spin_lock_irqsave(&down_cpumask_lock, flags);
 		cpumask_set_cpu(data, &down_cpumask);
 		spin_unlock_irqrestore(&down_cpumask_lock, flags);
 		queue_work(down_wq, &freq_scale_down_work);
 	} else {
 		pcpu->target_freq = new_freq;
+		spin_unlock_irqrestore(&pcpu->target_freq_lock, flags);
 #if DEBUG
 		up_request_time = ktime_to_us(ktime_get());
 #endif
@@ -337,6 +510,11 @@ exit:
 	return;
 }
 
+/* Only wakes the CPU, the deferred sampling timer then runs. */
+static void cpufreq_interactive_nop_timer(unsigned long data)
+{
+}
+
 static void cpufreq_interactive_idle(void)
 {
 	struct cpufreq_interactive_cpuinfo *pcpu =
@@ -372,6 +550,13 @@ static void cpufreq_interactive_idle(void)
 			      pcpu->idle_exit_time);
 		}
 #endif
+		/*
+		 * The sampling timer is deferrable and won't wake this CPU,
+		 * don't sit above min speed for longer than the slack.
+		 */
+		if (timer_slack >= 0 && timer_pending(&pcpu->cpu_timer))
+			mod_timer_pinned(&pcpu->cpu_slack_timer,
+				jiffies + usecs_to_jiffies(timer_slack));
 	} else {
 		/*
 		 * If at min speed and entering idle after load has
@@ -426,10 +611,66 @@ static void cpufreq_interactive_idle(void)
 
 }
 
+/* Runs on a boosted CPU that was idle, see cpufreq_interactive_boost_cpu(). */
+static void cpufreq_interactive_boost_idle(void *data)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, smp_processor_id());
+
+	if (timer_slack >= 0)
+		mod_timer_pinned(&pcpu->cpu_slack_timer,
+			boostpulse_endtime + usecs_to_jiffies(timer_slack));
+}
+
+/*
+ * Raise the CPU's target to hispeed_freq for a boost pulse, returns
+ * nonzero if the up task has to apply it.
+ */
+static int cpufreq_interactive_boost_cpu(unsigned int cpu)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	unsigned int index;
+	unsigned long flags;
+	int raised = 0;
+
+	smp_rmb();
+
+	if (!pcpu->governor_enabled)
+		return 0;
+
+	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+					   cpufreq_interactive_hispeed(pcpu),
+					   CPUFREQ_RELATION_H, &index))
+		return 0;
+
+	spin_lock_irqsave(&pcpu->target_freq_lock, flags);
+
+	if (pcpu->target_freq < pcpu->freq_table[index].frequency) {
+		pcpu->target_freq = pcpu->freq_table[index].frequency;
+		raised = 1;
+	}
+
+	spin_unlock_irqrestore(&pcpu->target_freq_lock, flags);
+
+	/*
+	 * A CPU that went idle at min speed has no timer left to ramp it
+	 * back down after the pulse.  Wake it to arm the slack timer, if it
+	 * enters idle after this it sees the new target and arms it itself.
+	 */
+	smp_mb();
+
+	if (raised && pcpu->idling)
+		smp_call_function_single(cpu, cpufreq_interactive_boost_idle,
+					 NULL, 0);
+
+	return raised;
+}
+
 static int cpufreq_interactive_up_task(void *data)
 {
 	unsigned int cpu;
 	cpumask_t tmp_mask;
+	cpumask_t boost_mask;
 	unsigned long flags;
 	struct cpufreq_interactive_cpuinfo *pcpu;
 
@@ -443,7 +684,8 @@ static int cpufreq_interactive_up_task(void *data)
 		set_current_state(TASK_INTERRUPTIBLE);
 		spin_lock_irqsave(&up_cpumask_lock, flags);
 
-		if (cpumask_empty(&up_cpumask)) {
+		if (cpumask_empty(&up_cpumask) &&
+		    cpumask_empty(&boost_cpumask)) {
 			spin_unlock_irqrestore(&up_cpumask_lock, flags);
 			schedule();
 
@@ -469,8 +711,15 @@ static int cpufreq_interactive_up_task(void *data)
 
 		tmp_mask = up_cpumask;
 		cpumask_clear(&up_cpumask);
+		boost_mask = boost_cpumask;
+		cpumask_clear(&boost_cpumask);
 		spin_unlock_irqrestore(&up_cpumask_lock, flags);
 
+		for_each_cpu(cpu, &boost_mask) {
+			if (cpufreq_interactive_boost_cpu(cpu))
+				cpumask_set_cpu(cpu, &tmp_mask);
+		}
+
 		for_each_cpu(cpu, &tmp_mask) {
 			pcpu = &per_cpu(cpuinfo, cpu);
 
@@ -527,6 +776,119 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
+/*
+ * Start a boost pulse: the up task raises every CPU below hispeed_freq to
+ * it and the timer holds it there for boostpulse_duration.  Callable from
+ * atomic context.
+ */
+static void cpufreq_interactive_boost(void)
+{
+	unsigned long duration = usecs_to_jiffies(boostpulse_duration);
+	unsigned long flags;
+
+	/*
+	 * Touch reports come in at the panel's scan rate, only renew the
+	 * pulse once half of it has run out.
+	 */
+	if (boostpulse_active &&
+	    time_before(jiffies + duration / 2, boostpulse_endtime))
+		return;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	boostpulse_endtime = jiffies + duration;
+	boostpulse_active = 1;
+	cpumask_copy(&boost_cpumask, cpu_online_mask);
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+
+	dbgpr("boost: hispeed for %luus\n", boostpulse_duration);
+	wake_up_process(up_task);
+}
+
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	if (!input_boost)
+		return;
+
+	/* Key presses and touch reports, not releases or sync frames. */
+	if ((type == EV_KEY && value) || type == EV_ABS)
+		cpufreq_interactive_boost();
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_free;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	/* multi-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	/* single-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	/* keypads and buttons */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+
 static ssize_t show_go_maxspeed_load(struct kobject *kobj,
 				     struct attribute *attr, char *buf)
 {
@@ -557,9 +919,209 @@ static ssize_t store_min_sample_time(struct kobject *kobj,
 static struct global_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
 		show_min_sample_time, store_min_sample_time);
 
+static unsigned int *cpufreq_interactive_parse_loads(const char *buf,
+						     int *ntokens)
+{
+	const char *cp;
+	int i;
+	int n = 1;
+	unsigned int *tokens;
+
+	cp = buf;
+	while ((cp = strpbrk(cp + 1, " :")))
+		n++;
+
+	/* loads and speeds alternate, starting and ending with a load */
+	if (!(n & 1))
+		return ERR_PTR(-EINVAL);
+
+	tokens = kmalloc(n * sizeof(unsigned int), GFP_KERNEL);
+	if (!tokens)
+		return ERR_PTR(-ENOMEM);
+
+	cp = buf;
+	for (i = 0; i < n; i++) {
+		if (sscanf(cp, "%u", &tokens[i]) != 1)
+			goto err_kfree;
+
+		if (i & 1) {
+			if (i > 1 && tokens[i] <= tokens[i - 2])
+				goto err_kfree;
+		} else if (!tokens[i] || tokens[i] > 100) {
+			goto err_kfree;
+		}
+
+		cp = strpbrk(cp, " :");
+		if (!cp)
+			break;
+		cp++;
+	}
+
+	if (i != n - 1)
+		goto err_kfree;
+
+	*ntokens = n;
+	return tokens;
+
+err_kfree:
+	kfree(tokens);
+	return ERR_PTR(-EINVAL);
+}
+
+static ssize_t show_target_loads(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	int i;
+	ssize_t ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+
+	for (i = 0; i < ntarget_loads; i++)
+		ret += sprintf(buf + ret, "%u%s", target_loads[i],
+			       i & 1 ? ":" : " ");
+
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	buf[ret - 1] = '\n';
+	return ret;
+}
+
+static ssize_t store_target_loads(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ntokens;
+	unsigned int *new_target_loads;
+	unsigned int *old_target_loads;
+	unsigned long flags;
+
+	new_target_loads = cpufreq_interactive_parse_loads(buf, &ntokens);
+	if (IS_ERR(new_target_loads))
+		return PTR_ERR(new_target_loads);
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	old_target_loads = target_loads;
+	target_loads = new_target_loads;
+	ntarget_loads = ntokens;
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+
+	if (old_target_loads != default_target_loads)
+		kfree(old_target_loads);
+
+	return count;
+}
+
+static struct global_attr target_loads_attr = __ATTR(target_loads, 0644,
+		show_target_loads, store_target_loads);
+
+static ssize_t show_timer_slack(struct kobject *kobj,
+				struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", timer_slack);
+}
+
+static ssize_t store_timer_slack(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	long val;
+
+	ret = strict_strtol(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	if (val < -1)
+		return -EINVAL;
+
+	timer_slack = val;
+	return count;
+}
+
+static struct global_attr timer_slack_attr = __ATTR(timer_slack, 0644,
+		show_timer_slack, store_timer_slack);
+
+static ssize_t show_hispeed_freq(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hispeed_freq);
+}
+
+static ssize_t store_hispeed_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+
+	ret = strict_strtoul(buf, 0, &hispeed_freq);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static struct global_attr hispeed_freq_attr = __ATTR(hispeed_freq, 0644,
+		show_hispeed_freq, store_hispeed_freq);
+
+static ssize_t show_boostpulse_duration(struct kobject *kobj,
+					struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boostpulse_duration);
+}
+
+static ssize_t store_boostpulse_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+
+	ret = strict_strtoul(buf, 0, &boostpulse_duration);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static struct global_attr boostpulse_duration_attr =
+	__ATTR(boostpulse_duration, 0644,
+	       show_boostpulse_duration, store_boostpulse_duration);
+
+static ssize_t show_input_boost(struct kobject *kobj,
+				struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost);
+}
+
+static ssize_t store_input_boost(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+
+	ret = strict_strtoul(buf, 0, &input_boost);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static struct global_attr input_boost_attr = __ATTR(input_boost, 0644,
+		show_input_boost, store_input_boost);
+
+static ssize_t store_boostpulse(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	cpufreq_interactive_boost();
+	return count;
+}
+
+static struct global_attr boostpulse_attr = __ATTR(boostpulse, 0200,
+		NULL, store_boostpulse);
+
 static struct attribute *interactive_attributes[] = {
 	&go_maxspeed_load_attr.attr,
 	&min_sample_time_attr.attr,
+	&target_loads_attr.attr,
+	&timer_slack_attr.attr,
+	&hispeed_freq_attr.attr,
+	&boostpulse_duration_attr.attr,
+	&input_boost_attr.attr,
+	&boostpulse_attr.attr,
 	NULL,
 };
 
@@ -600,6 +1162,13 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (rc)
 			return rc;
 
+		rc = input_register_handler(&cpufreq_interactive_input_handler);
+		if (rc)
+			pr_warning("cpufreq_interactive: no input boost (%d)\n",
+				   rc);
+		else
+			input_handler_registered = 1;
+
 		pm_idle_old = pm_idle;
 		pm_idle = cpufreq_interactive_idle;
 		break;
@@ -608,6 +1177,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		pcpu->governor_enabled = 0;
 		smp_wmb();
 		del_timer_sync(&pcpu->cpu_timer);
+		del_timer_sync(&pcpu->cpu_slack_timer);
 		flush_work(&freq_scale_down_work);
 		/*
 		 * Reset idle exit time since we may cancel the timer
@@ -620,6 +1190,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+		if (input_handler_registered) {
+			input_unregister_handler(
+				&cpufreq_interactive_input_handler);
+			input_handler_registered = 0;
+		}
+
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 
@@ -646,13 +1222,17 @@ static int __init cpufreq_interactive_init(void)
 
 	go_maxspeed_load = DEFAULT_GO_MAXSPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
+	boostpulse_duration = DEFAULT_BOOSTPULSE_DURATION;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
 		pcpu = &per_cpu(cpuinfo, i);
-		init_timer(&pcpu->cpu_timer);
+		init_timer_deferrable(&pcpu->cpu_timer);
 		pcpu->cpu_timer.function = cpufreq_interactive_timer;
 		pcpu->cpu_timer.data = i;
+		init_timer(&pcpu->cpu_slack_timer);
+		pcpu->cpu_slack_timer.function = cpufreq_interactive_nop_timer;
+		spin_lock_init(&pcpu->target_freq_lock);
 	}
 
 	up_task = kthread_create(cpufreq_interactive_up_task, NULL,
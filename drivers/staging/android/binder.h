@@ -21,6 +21,7 @@
 #define _LINUX_BINDER_H
 
 #include <linux/ioctl.h>
+#include <linux/uio.h>
 
 #define B_PACK_CHARS(c1, c2, c3, c4) \
 	((((c1)<<24)) | (((c2)<<16)) | (((c3)<<8)) | (c4))
@@ -147,6 +148,18 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Scatter-gather variant of binder_transaction_data. The data buffer is
+ * gathered from iov[0..iov_count) straight into the target's buffer
+ * instead of from transaction_data.data.ptr.buffer. The iovec lengths
+ * must add up to transaction_data.data_size.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	const struct iovec __user *iov;
+	size_t			iov_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +337,14 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command.
+	 * Same as BC_TRANSACTION and BC_REPLY, with the data gathered
+	 * from a list of user iovecs.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
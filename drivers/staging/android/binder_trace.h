@@ -0,0 +1,92 @@
+/* binder_trace.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, int debug_id, int to_node, int to_proc,
+		 int to_thread, unsigned int code, unsigned int flags),
+	TP_ARGS(reply, debug_id, to_node, to_proc, to_thread, code, flags),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, to_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->to_node = to_node;
+		__entry->to_proc = to_proc;
+		__entry->to_thread = to_thread;
+		__entry->reply = reply;
+		__entry->code = code;
+		__entry->flags = flags;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->to_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(int debug_id, s64 wait_ns),
+	TP_ARGS(debug_id, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("transaction=%d wait_ns=%lld",
+		  __entry->debug_id, (long long)__entry->wait_ns)
+);
+
+TRACE_EVENT(binder_reply,
+	TP_PROTO(int debug_id, int in_reply_to, s64 latency_ns),
+	TP_ARGS(debug_id, in_reply_to, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, in_reply_to)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->in_reply_to = in_reply_to;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("transaction=%d in_reply_to=%d latency_ns=%lld",
+		  __entry->debug_id, __entry->in_reply_to,
+		  (long long)__entry->latency_ns)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
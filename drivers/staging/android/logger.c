@@ -19,46 +19,115 @@
 
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/io.h>
+#include <linux/cred.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* the priorities liblog puts in the first byte of text log payloads */
+#define LOGGER_PRIO_DEBUG	3
+#define LOGGER_PRIO_INFO	4
+#define LOGGER_PRIO_ERROR	6
+
+/*
+ * Each uid/tag pair may write 'ratelimit_rate' entries per second, with
+ * bursts of up to 'ratelimit_burst' entries; zero rate disables the limit.
+ * Entries at LOGGER_PRIO_ERROR and above are never rate limited.
+ */
+static unsigned int logger_ratelimit_rate = 200;
+module_param_named(ratelimit_rate, logger_ratelimit_rate, uint,
+		   S_IWUSR | S_IRUGO);
+static unsigned int logger_ratelimit_burst = 1000;
+module_param_named(ratelimit_burst, logger_ratelimit_burst, uint,
+		   S_IWUSR | S_IRUGO);
+
+/*
+ * When the log is full, entries below 'evict_prio' are evicted before older
+ * entries at or above it.
+ */
+static unsigned int logger_evict_prio = LOGGER_PRIO_INFO;
+module_param_named(evict_prio, logger_evict_prio, uint, S_IWUSR | S_IRUGO);
+
+#define LOGGER_TAG_PEEK		32	/* bytes of a payload used as its key */
+#define LOGGER_BUCKET_BITS	6
+#define LOGGER_COMPACT_WINDOW	(2 * LOGGER_ENTRY_MAX_LEN)
+
+/*
+ * struct logger_bucket - token bucket of one uid/tag pair. Buckets are
+ * direct mapped by key and colliding pairs share one, so a pair cannot
+ * refill its bucket by evicting another.
+ */
+struct logger_bucket {
+	unsigned long		stamp;	/* jiffies of the last refill */
+	unsigned long		tokens;	/* in units of 1/HZ entries */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the reader list are
+ * protected by the spinlock 'lock'.
+ *
+ * Writers only hold the lock to reserve space for an entry at w_off and,
+ * once the payload has been copied in without the lock, to commit it.
+ * Entries between 'commit' and 'w_off' are still being written and are not
+ * visible to readers; 'commit' only moves past an entry once it and every
+ * entry before it have been committed.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting for a commit */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting offsets, readers */
+	size_t			w_off;	/* current reservation head offset */
+	size_t			commit;	/* readable entries end here */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_hdr; /* indices for mmap readers */
+	bool			text;	/* payloads start with prio and tag */
+	unsigned char		*compact_buf; /* entries kept by eviction */
+	size_t			clean_end; /* none to evict from head to here */
+	struct logger_bucket	buckets[1 << LOGGER_BUCKET_BITS];
+	struct logger_drop_stats drops;	/* entries we did not keep */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned char		*entry;	/* bounce buffer for one entry */
+	struct mutex		read_lock; /* serialises reads into entry */
+	bool			batch;	/* read() returns all entries that fit */
 };
 
+/*
+ * While an entry is in the ring its __pad field tracks its state. Readers
+ * only ever see committed entries, so user-space still reads back zero.
+ */
+#define LOGGER_ENTRY_COMMITTED	0
+#define LOGGER_ENTRY_RESERVED	1	/* payload is being copied in */
+#define LOGGER_ENTRY_DISCARDED	2	/* copy faulted, readers skip it */
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -86,12 +155,10 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
- *
- * Caller needs to hold log->mutex.
+ * get_log_u16 - Grabs the 16 bit value at 'off', which may wrap around the
+ * end of the log.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u16 get_log_u16(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
@@ -104,42 +171,166 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 		memcpy(&val, log->buffer + off, 2);
 	}
 
-	return sizeof(struct logger_entry) + val;
+	return val;
+}
+
+/*
+ * get_entry_len - Grabs the length of the payload of the next entry starting
+ * from 'off'.
+ *
+ * Caller needs to hold log->lock.
+ */
+static __u32 get_entry_len(struct logger_log *log, size_t off)
+{
+	return sizeof(struct logger_entry) + get_log_u16(log, off);
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * get_entry_state - returns the LOGGER_ENTRY_* state of the entry at 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static __u16 get_entry_state(struct logger_log *log, size_t off)
+{
+	return get_log_u16(log, logger_offset(off +
+				offsetof(struct logger_entry, __pad)));
+}
+
+/*
+ * set_entry_state - sets the LOGGER_ENTRY_* state of the entry at 'off'.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void set_entry_state(struct logger_log *log, size_t off, __u16 state)
+{
+	size_t pad = logger_offset(off + offsetof(struct logger_entry, __pad));
+
+	switch (log->size - pad) {
+	case 1:
+		memcpy(log->buffer + pad, &state, 1);
+		memcpy(log->buffer, ((char *) &state) + 1, 1);
+		break;
+	default:
+		memcpy(log->buffer + pad, &state, 2);
+	}
+}
+
+/*
+ * skip_discarded - moves 'off' past any discarded entries before the commit
+ * offset.
+ *
+ * Caller needs to hold log->lock.
+ */
+static size_t skip_discarded(struct logger_log *log, size_t off)
+{
+	while (off != log->commit &&
+	       get_entry_state(log, off) == LOGGER_ENTRY_DISCARDED)
+		off = logger_offset(off + get_entry_len(log, off));
+	return off;
+}
+
+/*
+ * get_entry_prio - returns the priority of the text log entry at 'off'.
+ *
+ * Caller needs to hold log->lock.
+ */
+static unsigned int get_entry_prio(struct logger_log *log, size_t off)
+{
+	return log->buffer[logger_offset(off + sizeof(struct logger_entry))];
+}
+
+/*
+ * is_low_priority - may the entry at 'off' be evicted ahead of older ones?
+ *
+ * Caller needs to hold log->lock.
+ */
+static int is_low_priority(struct logger_log *log, size_t off)
+{
+	return get_entry_state(log, off) == LOGGER_ENTRY_DISCARDED ||
+		get_entry_prio(log, off) < logger_evict_prio;
+}
+
+/*
+ * do_read_log - copies exactly 'count' bytes at 'off' out of 'log' into
+ * 'buf'.
+ *
+ * Caller must hold log->lock.
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
 {
 	size_t len;
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * the offset up to 'count' bytes or to the end of the log, whichever
+	 * comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * do_read_log_batch - reads as many whole entries as fit in 'count' bytes
+ * into the user-space buffer 'buf', one bounce buffer full at a time.
+ * Returns the number of bytes read, 0 if there was nothing left to read
+ * or -EINVAL if the next entry alone does not fit.
+ */
+static ssize_t do_read_log_batch(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf, size_t count)
+{
+	ssize_t ret = 0;
 
-	reader->r_off = logger_offset(reader->r_off + count);
+	while (1) {
+		size_t r_off, off;
+		size_t chunk = 0;
+		bool too_big = false;
+
+		spin_lock(&log->lock);
+		r_off = off = reader->r_off;
+		while (off != log->commit) {
+			size_t len = get_entry_len(log, off);
+
+			if (get_entry_state(log, off) != LOGGER_ENTRY_DISCARDED) {
+				if (ret + chunk + len > count) {
+					too_big = true;
+					break;
+				}
+				if (chunk + len > LOGGER_ENTRY_MAX_LEN)
+					break;
+				do_read_log(log, off, reader->entry + chunk, len);
+				chunk += len;
+			}
+			off = logger_offset(off + len);
+		}
+		/* consumed, see logger_read() */
+		reader->r_off = off;
+		spin_unlock(&log->lock);
+
+		if (!chunk)
+			return (!ret && too_big) ? -EINVAL : ret;
+
+		if (copy_to_user(buf + ret, reader->entry, chunk)) {
+			/* give the entries back unless a writer fixed us up */
+			spin_lock(&log->lock);
+			if (reader->r_off == off)
+				reader->r_off = r_off;
+			spin_unlock(&log->lock);
+			return ret ? ret : -EFAULT;
+		}
+		ret += chunk;
 
-	return count;
+		if (too_big)
+			return ret;
+	}
 }
 
 /*
@@ -149,7 +340,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode as many
+ * 	  whole entries as fit in the buffer
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -162,13 +354,16 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
+	size_t r_off;
+
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		reader->r_off = skip_discarded(log, reader->r_off);
+		ret = (log->commit == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,27 +384,61 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	/*
+	 * Concurrent reads on one file would share the bounce buffer and
+	 * the read head; let them take turns.
+	 */
+	if (mutex_lock_interruptible(&reader->read_lock))
+		return -EINTR;
+
+	if (reader->batch) {
+		ret = do_read_log_batch(log, reader, buf, count);
+		mutex_unlock(&reader->read_lock);
+		if (unlikely(!ret))
+			goto start;
+		return ret;
+	}
+
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	reader->r_off = skip_discarded(log, reader->r_off);
+	if (unlikely(log->commit == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->read_lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/*
+	 * Get exactly one entry from the log. It is copied out under the lock
+	 * so a writer cannot overwrite it, and to user-space without it. The
+	 * entry counts as consumed from here on, so a writer that moves
+	 * entries in the meantime does not hand it to us again.
+	 */
+	r_off = reader->r_off;
+	do_read_log(log, r_off, reader->entry, ret);
+	reader->r_off = logger_offset(r_off + ret);
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->entry, ret)) {
+		/* give the entry back unless a writer fixed us up */
+		spin_lock(&log->lock);
+		if (reader->r_off == logger_offset(r_off + ret))
+			reader->r_off = r_off;
+		spin_unlock(&log->lock);
+		ret = -EFAULT;
+	}
 
 out:
-	mutex_unlock(&log->mutex);
-
+	mutex_unlock(&reader->read_lock);
 	return ret;
 }
 
@@ -217,7 +446,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -249,13 +478,126 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at 'off'
+ *
+ * The caller needs to hold log->lock, or to have reserved the space.
+ */
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
+
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * evict_low_priority - an entry of 'len' bytes is about to overwrite the
+ * oldest entries. If one of them is worth keeping, evict the low priority
+ * entries from the oldest LOGGER_COMPACT_WINDOW bytes of the log instead,
+ * sliding the entries we keep forward so that their order is preserved.
+ *
+ * All low priority entries in the window go at once, so the room made lasts
+ * for several writes instead of compacting the window on each of them, and
+ * 'clean_end' remembers how far from the head there is nothing left to
+ * evict so the next scan starts there.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void evict_low_priority(struct logger_log *log, size_t len)
+{
+	struct logger_reader *reader;
+	size_t off, n, win, kept, dropped = 0;
+	unsigned int count = 0;
+
+	/* would we overwrite anything but low priority entries? */
+	for (off = log->head, win = 0; win < len; win += n) {
+		if (off == log->commit)
+			return;
+		if (!is_low_priority(log, off))
+			break;
+		n = get_entry_len(log, off);
+		off = logger_offset(off + n);
+	}
+	if (win >= len)
+		return;
+
+	/* find the low priority entries near the head, past the clean part */
+	off = log->head;
+	win = logger_offset(log->clean_end - log->head);
+	if (win <= logger_offset(log->commit - log->head))
+		off = log->clean_end;
+	else
+		win = 0;
+	for (; off != log->commit; win += n) {
+		n = get_entry_len(log, off);
+		if (win + n > LOGGER_COMPACT_WINDOW)
+			break;
+		if (is_low_priority(log, off)) {
+			dropped += n;
+			count++;
+		}
+		off = logger_offset(off + n);
+	}
+	if (!dropped) {
+		log->clean_end = off;
+		return;
+	}
+
+	/*
+	 * Readers in the window follow the entry they were about to read.
+	 * Everything before r_off was consumed, logger_read() and batched
+	 * reads advance r_off before they drop the lock.
+	 */
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t before = 0;
+
+		if (logger_offset(reader->r_off - log->head) >= win)
+			continue;
+		for (off = log->head; off != reader->r_off;
+		     off = logger_offset(off + n)) {
+			n = get_entry_len(log, off);
+			if (is_low_priority(log, off))
+				before += n;
+		}
+		reader->r_off = logger_offset(reader->r_off + dropped - before);
+	}
+
+	for (off = log->head, kept = 0; kept + dropped < win;
+	     off = logger_offset(off + n)) {
+		n = get_entry_len(log, off);
+		if (is_low_priority(log, off))
+			continue;
+		do_read_log(log, off, log->compact_buf + kept, n);
+		kept += n;
+	}
+
+	/*
+	 * mmap readers see an odd 'moved' while entries are being moved and
+	 * retry, like a seqcount.
+	 */
+	log->mmap_hdr->moved++;
+	smp_wmb();
+	log->clean_end = logger_offset(log->head + win);
+	log->head = logger_offset(log->head + dropped);
+	do_write_log(log, log->head, log->compact_buf, kept);
+	log->mmap_hdr->head = log->head;
+	smp_wmb();
+	log->mmap_hdr->moved++;
+	log->drops.evicted += count;
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -263,8 +605,14 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		if (log->text)
+			evict_low_priority(log, len);
+		if (clock_interval(old, new, log->head))
+			log->head = get_next_entry(log, log->head, len);
+		log->mmap_hdr->head = log->head;
+		smp_wmb();
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -272,48 +620,173 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
+ * the log 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have reserved the space, it does not need to hold any lock.
+ *
+ * Returns 'count' on success, negative error code on failure.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
+				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
+		return -EFAULT;
 
 	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
+		if (copy_from_user(log->buffer, buf + len, count - len))
+			return -EFAULT;
 
+	return count;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * would_overrun - would reserving 'len' more bytes reach an entry that is
+ * still being written?
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
+ */
+static inline int would_overrun(struct logger_log *log, size_t len)
+{
+	return log->commit != log->w_off &&
+		clock_interval(log->w_off, logger_offset(log->w_off + len),
+			       log->commit);
+}
+
+/*
+ * get_entry_key - peeks at the start of the payload about to be written to
+ * find its priority and the hash of its uid and tag. Binary logs start with
+ * a 32 bit tag and have no priority. The first bytes of the payload are left
+ * in 'peek', '*peeked' tells how many, so they need not be copied again.
+ */
+static u32 get_entry_key(struct logger_log *log, const struct iovec *iov,
+			 unsigned long nr_segs, size_t count, unsigned int *prio,
+			 char *peek, size_t *peeked)
+{
+	size_t len = 0;
+
+	count = min_t(size_t, count, LOGGER_TAG_PEEK);
+	while (nr_segs-- > 0 && len < count) {
+		size_t n = min_t(size_t, iov->iov_len, count - len);
+
+		if (copy_from_user(peek + len, iov->iov_base, n))
+			break;
+		len += n;
+		iov++;
+	}
+	*peeked = len;
+
+	if (!log->text) {
+		*prio = LOGGER_PRIO_INFO;
+		return jhash(peek, min_t(size_t, len, sizeof(u32)),
+			     current_uid());
+	}
+
+	if (!len) {
+		*prio = 0;
+		return current_uid();
+	}
+	*prio = (unsigned char) peek[0];
+	return jhash(peek + 1, strnlen(peek + 1, len - 1), current_uid());
+}
+
+/*
+ * logger_admit - takes a token from the bucket of 'key', returns zero if
+ * the entry is over its rate and must be dropped.
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller needs to hold log->lock.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int logger_admit(struct logger_log *log, u32 key, unsigned int prio)
 {
-	size_t len;
+	struct logger_bucket *b;
+	unsigned long rate = logger_ratelimit_rate;
+	unsigned long burst = (unsigned long) logger_ratelimit_burst * HZ;
+	unsigned long elapsed;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	if (!rate || prio >= LOGGER_PRIO_ERROR)
+		return 1;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	b = &log->buckets[hash_32(key, LOGGER_BUCKET_BITS)];
+	elapsed = min(jiffies - b->stamp, burst);
+	b->tokens = min(b->tokens + elapsed * rate, burst);
+	b->stamp = jiffies;
+
+	if (b->tokens < HZ) {
+		log->drops.ratelimited++;
+		return 0;
+	}
+	b->tokens -= HZ;
+	return 1;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * reserve_entry - reserves room for an entry of 'len' bytes, writes its
+ * header and returns its offset. Waits, without the lock, if the log is so
+ * full of uncommitted entries that the new one would overwrite them.
+ * Returns -EBUSY if the uid/tag pair 'key' is over its rate limit.
+ */
+static ssize_t reserve_entry(struct logger_log *log,
+			     struct logger_entry *header, size_t len,
+			     u32 key, unsigned int prio)
+{
+	size_t off;
 
-	return count;
+	spin_lock(&log->lock);
+	if (!logger_admit(log, key, prio)) {
+		spin_unlock(&log->lock);
+		return -EBUSY;
+	}
+
+	while (unlikely(would_overrun(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq, !would_overrun(log, len));
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, len);
+
+	off = log->w_off;
+	header->__pad = LOGGER_ENTRY_RESERVED;
+	do_write_log(log, off, header, sizeof(struct logger_entry));
+	log->w_off = logger_offset(off + len);
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * commit_entry - marks the entry at 'off' as committed or discarded and
+ * advances the commit offset over every finished entry it unblocks.
+ */
+static void commit_entry(struct logger_log *log, size_t off, __u16 state)
+{
+	size_t old;
+
+	spin_lock(&log->lock);
+	set_entry_state(log, off, state);
+	old = log->commit;
+	while (log->commit != log->w_off &&
+	       get_entry_state(log, log->commit) != LOGGER_ENTRY_RESERVED)
+		log->commit = logger_offset(log->commit +
+					    get_entry_len(log, log->commit));
+	/* entry contents must be visible before mmap readers see commit */
+	smp_wmb();
+	log->mmap_hdr->commit = log->commit;
+	spin_unlock(&log->lock);
+
+	if (old != log->commit) {
+		/* wake up any blocked readers and writers */
+		wake_up_interruptible(&log->wq);
+		if (waitqueue_active(&log->commit_wq))
+			wake_up(&log->commit_wq);
+	}
 }
 
 /*
@@ -325,10 +798,15 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off, w_off;
+	__u16 state = LOGGER_ENTRY_COMMITTED;
+	char peek[LOGGER_TAG_PEEK];
+	size_t peeked, skip;
+	unsigned int prio;
 	ssize_t ret = 0;
+	u32 key;
 
 	now = current_kernel_time();
 
@@ -342,41 +820,46 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	key = get_entry_key(log, iov, nr_segs, header.len, &prio,
+			    peek, &peeked);
+	ret = reserve_entry(log, &header,
+			    sizeof(struct logger_entry) + header.len, key, prio);
+	/* rate limited entries are dropped silently, as if written */
+	if (unlikely(ret < 0))
+		return header.len;
+	off = ret;
+	w_off = logger_offset(off + sizeof(struct logger_entry));
+
+	/* the bytes get_entry_key() peeked at are in the kernel already */
+	do_write_log(log, w_off, peek, peeked);
+	w_off = logger_offset(w_off + peeked);
+	ret = skip = peeked;
 
 	while (nr_segs-- > 0) {
-		size_t len;
+		size_t done, len;
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		done = min_t(size_t, iov->iov_len, skip);
+		skip -= done;
+		len = min_t(size_t, iov->iov_len - done, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, w_off, iov->iov_base + done,
+					    len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/* the space is taken, so leave a hole readers skip */
+			state = LOGGER_ENTRY_DISCARDED;
+			ret = nr;
+			break;
 		}
 
+		w_off = logger_offset(w_off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	commit_entry(log, off, state);
 
 	return ret;
 }
@@ -408,13 +891,21 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->entry) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		reader->batch = false;
+		mutex_init(&reader->read_lock);
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +923,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->entry);
 		kfree(reader);
 	}
 
@@ -462,10 +958,11 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	reader->r_off = skip_discarded(log, reader->r_off);
+	if (log->commit != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -474,9 +971,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_drop_stats drops;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -488,10 +986,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->commit >= reader->r_off)
+			ret = log->commit - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->commit;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,7 +997,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		reader->r_off = skip_discarded(log, reader->r_off);
+		if (log->commit != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -510,22 +1009,73 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = log->commit;
+		log->head = log->commit;
+		log->mmap_hdr->head = log->head;
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_GET_DROP_STATS:
+		drops = log->drops;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	if (cmd == LOGGER_GET_DROP_STATS &&
+	    copy_to_user((void __user *)arg, &drops, sizeof(drops)))
+		ret = -EFAULT;
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps a struct logger_mmap_header page followed by the ring itself, read
+ * only, so readers can consume entries without a system call. Only the
+ * whole mapping from offset zero is supported.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->mmap_hdr) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -535,10 +1085,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is page aligned so it can
+ * be mapped to user-space.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE, TEXT) \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -548,17 +1099,20 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.commit = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.text = TEXT, \
 };
 
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024, true)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024, false)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024, true)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024, true)
 
 static struct logger_log *get_log_from_minor(int minor)
 {
@@ -577,17 +1131,36 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_hdr = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!log->mmap_hdr)
+		return -ENOMEM;
+	log->mmap_hdr->size = log->size;
+
+	if (log->text) {
+		log->compact_buf = kmalloc(LOGGER_COMPACT_WINDOW, GFP_KERNEL);
+		if (!log->compact_buf) {
+			ret = -ENOMEM;
+			goto err_free_hdr;
+		}
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
-		return ret;
+		goto err_free_buf;
 	}
 
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
 	return 0;
+
+err_free_buf:
+	kfree(log->compact_buf);
+err_free_hdr:
+	free_page((unsigned long)log->mmap_hdr);
+	return ret;
 }
 
 static int __init logger_init(void)
@@ -45,5 +45,31 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_BATCH		_IO(__LOGGERIO, 5) /* batched read() */
+#define LOGGER_GET_DROP_STATS		_IOR(__LOGGERIO, 6, struct logger_drop_stats)
+
+/* entries the log did not keep, see LOGGER_GET_DROP_STATS */
+struct logger_drop_stats {
+	__u32		ratelimited;	/* writes rejected by uid/tag limits */
+	__u32		evicted;	/* low priority entries evicted early */
+};
+
+/*
+ * A read-only mmap() of a log starts with this header page, followed by the
+ * ring itself. Entries from 'head' up to 'commit' are complete; entries
+ * whose __pad is not zero were discarded and must be skipped. Readers keep
+ * their own offset. 'moved' works like a seqcount: it is odd while old
+ * entries are being moved. Readers read it before copying an entry and wait
+ * while it is odd; after copying, and a read barrier, they must check that
+ * 'head' has not moved past the entry and that 'moved' did not change,
+ * otherwise it may have been overwritten and they have to restart from
+ * 'head'.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the ring */
+	__u32		head;	/* oldest entry still in the ring */
+	__u32		commit;	/* entries end here */
+	__u32		moved;	/* odd while old entries are being moved */
+};
 
 #endif /* _LINUX_LOGGER_H */
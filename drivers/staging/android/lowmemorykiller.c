@@ -16,6 +16,20 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Candidate processes are kept in lists by oom_adj, updated when a process
+ * forks, execs, exits or has its oom_adj written, so finding a victim only
+ * looks at the highest oom_adj that has any. The number of kills and how long it took
+ * to pick each victim and for it to die, in microseconds, can be read from
+ * the kill_count, select_us_* and kill_us_* parameters.
+ *
+ * Reclaim only wakes up the lowmemorykiller thread, which does the killing.
+ * It kills up to max_kills processes at a time, until their size covers the
+ * shortfall of free pages, then waits for them to exit before looking at
+ * the free memory again. Victims that take longer than kill_timeout_ms to
+ * exit are no longer waited for. A victim counts as gone once its last
+ * thread has dropped its mm; the pages are freed then unless something
+ * else, such as a /proc reader, still holds the mm for a moment longer.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +49,10 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,8 +70,38 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
-static struct task_struct *lowmem_deathpending;
-static unsigned long lowmem_deathpending_timeout;
+#define LOWMEM_MAX_VICTIMS	8
+static uint32_t lowmem_max_kills = 4;
+static uint32_t lowmem_kill_timeout_ms = 1000;
+
+/*
+ * struct lowmem_victim - a process we sent SIGKILL and are waiting for
+ */
+struct lowmem_victim {
+	struct task_struct	*task;	/* its thread group leader */
+	ktime_t			start;	/* when it was sent SIGKILL */
+};
+static struct lowmem_victim lowmem_victims[LOWMEM_MAX_VICTIMS];
+static int lowmem_nr_victims;
+
+static uint32_t lowmem_kill_count;
+static uint32_t lowmem_select_us_last;
+static uint32_t lowmem_select_us_max;
+static uint32_t lowmem_kill_us_last;
+static uint32_t lowmem_kill_us_max;
+
+/*
+ * Thread group leaders by oom_adj, from OOM_DISABLE up. Also protects the
+ * victims and the statistics above. Only taken from process context, from
+ * the oom_adj notifiers and the killer thread, so task_lock() nests inside.
+ */
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_lock);
+
+static struct task_struct *lowmem_task;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);	/* pressure or a death */
+static int lowmem_kick;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -62,49 +110,116 @@ static unsigned long lowmem_deathpending_timeout;
 	} while (0)
 
 static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data);
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
-static struct notifier_block task_nb = {
-	.notifier_call	= task_notify_func,
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
 };
 
+/*
+ * lowmem_victim_gone - forgets 'task' if it is one of our victims and wakes
+ * up the killer once the last one is gone.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static void lowmem_victim_gone(struct task_struct *task)
+{
+	uint32_t us;
+	int i;
+
+	for (i = 0; i < lowmem_nr_victims; i++) {
+		if (lowmem_victims[i].task != task)
+			continue;
+
+		us = ktime_to_us(ktime_sub(ktime_get(),
+					   lowmem_victims[i].start));
+		lowmem_kill_us_last = us;
+		if (us > lowmem_kill_us_max)
+			lowmem_kill_us_max = us;
+
+		lowmem_victims[i] = lowmem_victims[--lowmem_nr_victims];
+		if (!lowmem_nr_victims)
+			wake_up(&lowmem_wait);
+		break;
+	}
+}
+
+/*
+ * lowmem_update_task - moves the thread group of 'p' to the list of its
+ * current oom_adj, unless the whole group is already exiting.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static void lowmem_update_task(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	int oom_adj = leader->signal->oom_adj;
+
+	if (!atomic_read(&leader->signal->live))
+		return;
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	list_move_tail(&leader->lowmem_entry,
+		       &lowmem_buckets[oom_adj - OOM_DISABLE]);
+}
+
+/*
+ * lowmem_exec - the thread group of 'old' got a new leader in exec(), which
+ * takes over its place in the buckets and as a victim.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static void lowmem_exec(struct task_struct *old)
+{
+	struct task_struct *leader = old->group_leader;
+	int i;
+
+	if (list_empty(&old->lowmem_entry))
+		return;
+	list_del_init(&old->lowmem_entry);
+	lowmem_update_task(leader);
+	for (i = 0; i < lowmem_nr_victims; i++)
+		if (lowmem_victims[i].task == old)
+			lowmem_victims[i].task = leader;
+}
+
 static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data)
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
-	struct task_struct *task = data;
+	struct task_struct *p = data;
+
+	/* kernel threads are never candidates */
+	if (val == OOM_ADJ_FORK && !p->mm)
+		return NOTIFY_OK;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	spin_lock(&lowmem_lock);
+	if (val == OOM_ADJ_EXIT) {
+		list_del_init(&p->group_leader->lowmem_entry);
+		lowmem_victim_gone(p->group_leader);
+	} else if (val == OOM_ADJ_EXEC)
+		lowmem_exec(p);
+	else
+		lowmem_update_task(p);
+	spin_unlock(&lowmem_lock);
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+/*
+ * lowmem_min_adj - returns the lowest oom_adj we may kill at, or
+ * OOM_ADJUST_MAX + 1 if there is enough free memory. 'deficit' is set to
+ * the number of pages needed to get back above that level.
+ */
+static int lowmem_min_adj(int *deficit)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
 	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
-
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
@@ -112,72 +227,188 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
+			*deficit = lowmem_minfree[i] - other_free;
+			lowmem_print(3, "lowmem ofree %d %d, ma %d\n",
+				     other_free, other_file, lowmem_adj[i]);
+			return lowmem_adj[i];
+		}
+	}
+
+	*deficit = 0;
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * lowmem_select - sends SIGKILL to the largest process with the highest
+ * oom_adj that has any, not below 'min_adj'. Returns its size in pages, or
+ * zero if there was none.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static int lowmem_select(int min_adj)
+{
+	struct task_struct *p;
+	struct task_struct *selected = NULL;
+	int tasksize;
+	int selected_tasksize = 0;
+	int selected_oom_adj = min_adj;
+	ktime_t start = ktime_get();
+	uint32_t us;
+	int i;
+
+	for (i = OOM_ADJUST_MAX; i >= min_adj && !selected; i--) {
+		list_for_each_entry(p, &lowmem_buckets[i - OOM_DISABLE],
+				    lowmem_entry) {
+			/* already dying, possibly by our hand */
+			if (p->signal->flags & SIGNAL_GROUP_EXIT)
+				continue;
+			task_lock(p);
+			if (!p->mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = i;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, i, tasksize);
 		}
 	}
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
-			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
+	if (!selected)
+		return 0;
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, selected_tasksize);
+	lowmem_victims[lowmem_nr_victims].task = selected;
+	lowmem_victims[lowmem_nr_victims].start = ktime_get();
+	lowmem_nr_victims++;
+	force_sig(SIGKILL, selected);
+
+	us = ktime_to_us(ktime_sub(lowmem_victims[lowmem_nr_victims - 1].start,
+				   start));
+	lowmem_kill_count++;
+	lowmem_select_us_last = us;
+	if (us > lowmem_select_us_max)
+		lowmem_select_us_max = us;
+
+	return selected_tasksize;
+}
+
+/*
+ * lowmem_kill - kills processes until their sizes add up to the shortfall
+ * of free pages, or until max_kills are waiting to die.
+ */
+static void lowmem_kill(void)
+{
+	int deficit;
+	int min_adj = lowmem_min_adj(&deficit);
+	int freed = 0;
+	int size;
+
+	if (min_adj == OOM_ADJUST_MAX + 1)
+		return;
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	spin_lock(&lowmem_lock);
+	while (freed < deficit &&
+	       lowmem_nr_victims < min_t(uint32_t, lowmem_max_kills,
+					 LOWMEM_MAX_VICTIMS)) {
+		size = lowmem_select(min_adj);
+		if (!size)
+			break;
+		freed += size;
+	}
+	spin_unlock(&lowmem_lock);
+}
+
+/*
+ * lowmem_expire_victims - stops waiting for victims that were sent SIGKILL
+ * more than kill_timeout_ms ago.
+ */
+static void lowmem_expire_victims(void)
+{
+	ktime_t now = ktime_get();
+	int i;
+
+	spin_lock(&lowmem_lock);
+	for (i = 0; i < lowmem_nr_victims; ) {
+		if (ktime_to_ms(ktime_sub(now, lowmem_victims[i].start)) >=
+		    lowmem_kill_timeout_ms) {
+			lowmem_print(2, "gave up waiting for %d\n",
+				     lowmem_victims[i].task->pid);
+			lowmem_victims[i] = lowmem_victims[--lowmem_nr_victims];
+		} else
+			i++;
+	}
+	spin_unlock(&lowmem_lock);
+}
+
+static int lowmem_thread(void *data)
+{
+	struct sched_param param = { .sched_priority = 1 };
+
+	sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_wait, lowmem_kick ||
+					 kthread_should_stop());
+		lowmem_kick = 0;
+
+		/* let earlier victims free their memory before judging again */
+		wait_event_timeout(lowmem_wait, !lowmem_nr_victims,
+				   msecs_to_jiffies(lowmem_kill_timeout_ms));
+		lowmem_expire_victims();
+
+		lowmem_kill();
+	}
+
+	return 0;
+}
+
+/*
+ * lowmem_shrink - called from reclaim, which is when the free page count is
+ * below the watermarks. We only wake up the killer thread so the allocating
+ * task does not wait for the kill.
+ */
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	int rem;
+	int deficit;
+	int min_adj;
+
+	/*
+	 * If we already have deaths outstanding, then
+	 * bail out right away; indicating to vmscan
+	 * that we have nothing further to offer on
+	 * this pass.
+	 *
+	 */
+	if (lowmem_nr_victims)
+		return 0;
+
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
 		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
+	if (nr_to_scan <= 0) {
 		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+	min_adj = lowmem_min_adj(&deficit);
+	if (min_adj != OOM_ADJUST_MAX + 1 && !lowmem_kick) {
+		lowmem_kick = 1;
+		wake_up(&lowmem_wait);
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -188,15 +419,47 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
-	task_free_register(&task_nb);
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	lowmem_task = kthread_run(lowmem_thread, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_task))
+		return PTR_ERR(lowmem_task);
+
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	/* pick up the processes that were created before us */
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_lock);
+	for_each_process(p)
+		if (p->mm)
+			lowmem_update_task(p);
+	spin_unlock(&lowmem_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct task_struct *p, *next;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
-	task_free_unregister(&task_nb);
+	kthread_stop(lowmem_task);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+
+	spin_lock(&lowmem_lock);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		list_for_each_entry_safe(p, next, &lowmem_buckets[i],
+					 lowmem_entry)
+			list_del_init(&p->lowmem_entry);
+	lowmem_nr_victims = 0;
+	spin_unlock(&lowmem_lock);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +468,14 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(max_kills, lowmem_max_kills, uint, S_IRUGO | S_IWUSR);
+module_param_named(kill_timeout_ms, lowmem_kill_timeout_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(kill_count, lowmem_kill_count, uint, S_IRUGO);
+module_param_named(select_us_last, lowmem_select_us_last, uint, S_IRUGO);
+module_param_named(select_us_max, lowmem_select_us_max, uint, S_IRUGO);
+module_param_named(kill_us_last, lowmem_kill_us_last, uint, S_IRUGO);
+module_param_named(kill_us_max, lowmem_kill_us_max, uint, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
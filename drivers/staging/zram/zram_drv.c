@@ -19,15 +19,21 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/fs.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 
 #include "zram_drv.h"
 
@@ -67,6 +73,23 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static void zram_stat_compress(struct zram *zram, size_t clen, u64 ns)
+{
+	spin_lock(&zram->stat64_lock);
+	zram->stats.compr_pages++;
+	zram->stats.compr_out += clen;
+	zram->stats.compr_ns += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_stat_decompress(struct zram *zram, u64 ns)
+{
+	spin_lock(&zram->stat64_lock);
+	zram->stats.decompr_pages++;
+	zram->stats.decompr_ns += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -85,21 +108,187 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Each table entry is guarded by a bit spinlock in its flags, which also
+ * covers the object, page or block it refers to. Reads, writes, swap free
+ * notifications and writeback all take it, and the flags of an entry are
+ * only changed with it held. zram->lock, where also needed, comes first.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_LOCK, &zram->table[index].flags);
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_LOCK, &zram->table[index].flags);
+}
+
+/*
+ * Returns 1 if the page is one word repeated, which is stored in *element.
+ * Zero filled pages are the common case of this.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
+	return 1;
+}
+
+/*
+ * Finds an object with the same compressed data in the dedup tree. On a
+ * hit a reference to it is taken and its handle returned, 0 otherwise.
+ */
+static unsigned long zram_dedup_get(struct zram *zram, u32 hash,
+			const void *src, unsigned int clen)
+{
+	int found = 0;
+	struct rb_node *node;
+	struct zram_dedup *dd = NULL;
+	unsigned char *cmem;
+
+	spin_lock(&zram->dedup_lock);
+
+	/* Leftmost entry with this hash */
+	node = zram->dedup_tree.rb_node;
+	while (node) {
+		struct zram_dedup *this;
+
+		this = rb_entry(node, struct zram_dedup, node);
+		if (hash <= this->hash) {
+			if (hash == this->hash)
+				dd = this;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	/* Entries with equal hash are adjacent, compare the data */
+	while (dd && dd->hash == hash) {
+		if (dd->size == clen) {
+			cmem = zs_map_object(zram->mem_pool, dd->handle,
+					ZS_MM_RO);
+			found = !memcmp(cmem, src, clen);
+			zs_unmap_object(zram->mem_pool, dd->handle);
+			if (found)
+				break;
+		}
+
+		node = rb_next(&dd->node);
+		dd = node ? rb_entry(node, struct zram_dedup, node) : NULL;
+	}
+
+	if (found)
+		dd->refcount++;
+
+	spin_unlock(&zram->dedup_lock);
+	return found ? dd->handle : 0;
+}
+
+static int zram_dedup_cmp(struct zram_dedup *a, u32 hash,
+			unsigned long handle)
+{
+	if (a->hash != hash)
+		return a->hash < hash ? -1 : 1;
+	if (a->handle != handle)
+		return a->handle < handle ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Makes a freshly stored object available for sharing. Returns 1 if it was
+ * added, and the page storing it must be marked ZRAM_DEDUP.
+ */
+static int zram_dedup_add(struct zram *zram, unsigned long handle,
+			unsigned int clen, u32 hash)
+{
+	struct rb_node **link = &zram->dedup_tree.rb_node, *parent = NULL;
+	struct zram_dedup *dd;
+
+	dd = kmalloc(sizeof(*dd), GFP_NOIO);
+	if (!dd)
+		return 0;	/* just not shared */
+
+	dd->hash = hash;
+	dd->refcount = 1;
+	dd->handle = handle;
+	dd->size = clen;
+
+	spin_lock(&zram->dedup_lock);
+	while (*link) {
+		parent = *link;
+		if (zram_dedup_cmp(rb_entry(parent, struct zram_dedup, node),
+				hash, handle) > 0)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&dd->node, parent, link);
+	rb_insert_color(&dd->node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
 	return 1;
 }
 
+/*
+ * Drops the reference of a ZRAM_DEDUP page. Returns 1 if it was the last
+ * one, and the object must be freed.
+ */
+static int zram_dedup_put(struct zram *zram, u32 hash,
+			unsigned long handle)
+{
+	int last = 1;
+	int cmp;
+	struct rb_node *node;
+	struct zram_dedup *dd;
+
+	spin_lock(&zram->dedup_lock);
+	node = zram->dedup_tree.rb_node;
+	while (node) {
+		dd = rb_entry(node, struct zram_dedup, node);
+		cmp = zram_dedup_cmp(dd, hash, handle);
+		if (!cmp)
+			break;
+		node = cmp > 0 ? node->rb_left : node->rb_right;
+	}
+
+	if (WARN_ON(!node))
+		goto out;
+
+	last = !--dd->refcount;
+	if (last) {
+		rb_erase(&dd->node, &zram->dedup_tree);
+		kfree(dd);
+	}
+out:
+	spin_unlock(&zram->dedup_lock);
+	return last;
+}
+
+/* Frees what zram_reset_device left to the dedup tree */
+static void zram_dedup_destroy(struct zram *zram)
+{
+	struct rb_node *node;
+	struct zram_dedup *dd;
+
+	while ((node = rb_first(&zram->dedup_tree))) {
+		dd = rb_entry(node, struct zram_dedup, node);
+		rb_erase(node, &zram->dedup_tree);
+		zs_free(zram->mem_pool, dd->handle);
+		kfree(dd);
+	}
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -129,15 +318,56 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bd_lock);
+	blk = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_blocks, 1);
+	if (blk < zram->bd_nr_blocks)
+		__set_bit(blk, zram->bd_bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->bd_lock);
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bd_lock);
+	WARN_ON(!test_bit(blk, zram->bd_bitmap));
+	__clear_bit(blk, zram->bd_bitmap);
+	spin_unlock(&zram->bd_lock);
+}
+
+/* Caller must hold the slot lock of @index */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
 	void *obj;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	unsigned long handle = zram->table[index].handle;
 
-	if (unlikely(!page)) {
+	/* A writeback in progress must not use the old data */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, zram->table[index].bd_block);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].bd_block = 0;
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -151,17 +381,33 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	clen = zram->table[index].size;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		u32 hash;
+
+		obj = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+		hash = jhash(obj, clen, 0);
+		zs_unmap_object(zram->mem_pool, handle);
+
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		if (!zram_dedup_put(zram, hash, handle)) {
+			/* Object still used by other pages */
+			zram_stat_dec(&zram->stats.pages_dedup);
+			zram_stat_dec(&zram->stats.pages_stored);
+			zram->table[index].handle = 0;
+			zram->table[index].size = 0;
+			return;
+		}
+	}
 
-	xv_free(zram->mem_pool, page, offset);
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -169,8 +415,8 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -184,92 +430,471 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct page *page, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+/*
+ * zram_get_stream - returns the compression stream of the current CPU,
+ * locked. The caller may migrate while using it, the lock keeps other
+ * requests on this CPU out until it is done.
+ */
+static struct zram_stream *zram_get_stream(struct zram *zram)
 {
+	struct zram_stream *strm;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	strm = per_cpu_ptr(zram->streams, raw_smp_processor_id());
+	mutex_lock(&strm->lock);
+	return strm;
+}
 
-	if (unlikely(!zram->init_done)) {
-		set_bit(BIO_UPTODATE, &bio->bi_flags);
-		bio_endio(bio, 0);
+static void zram_put_stream(struct zram_stream *strm)
+{
+	mutex_unlock(&strm->lock);
+}
+
+static int zram_decompress_page(struct zram *zram, struct zram_stream *strm,
+				u32 index, struct page *page)
+{
+	int ret;
+	u64 start;
+	unsigned int clen = PAGE_SIZE;
+	unsigned char *user_mem, *cmem;
+
+	/* zsmalloc kmaps on its own, so map the object outside user_mem */
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+			ZS_MM_RO);
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	start = local_clock();
+	ret = crypto_comp_decompress(strm->tfm, cmem,
+		zram->table[index].size, user_mem, &clen);
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EIO;
+
+	kunmap_atomic(user_mem, KM_USER0);
+	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+
+	if (!ret)
+		zram_stat_decompress(zram, local_clock() - start);
+	return ret;
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronous page I/O on the backing device */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page *page,
+			unsigned long blk)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *w = container_of(work, struct zram_bdev_work,
+					work);
+
+	w->ret = zram_bdev_rw(w->zram, READ_SYNC, w->page, w->blk);
+}
+
+/*
+ * Bios submitted from within our make_request function are only issued
+ * after it returns, so waiting for one there would deadlock. Read from a
+ * worker instead.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+				unsigned long blk)
+{
+	struct zram_bdev_work w;
+
+	w.zram = zram;
+	w.page = page;
+	w.blk = blk;
+	INIT_WORK_ONSTACK(&w.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &w.work);
+	flush_work(&w.work);
+	destroy_work_on_stack(&w.work);
+
+	return w.ret;
+}
+
+static int zram_wb_eligible(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, u32 now)
+{
+	if (!zram->table[index].handle)
+		return 0;
+
+	/* Nothing to gain, or already on the way */
+	if (zram->table[index].flags & (BIT(ZRAM_ZERO) | BIT(ZRAM_SAME) |
+			BIT(ZRAM_DEDUP) | BIT(ZRAM_WB) | BIT(ZRAM_UNDER_WB)))
 		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return now - zram->table[index].ac_time >= zram->wb_idle_age;
+}
+
+/*
+ * Writes one page to the backing device if it qualifies. The locks are
+ * dropped during the write: a write or free of the page meanwhile clears
+ * ZRAM_UNDER_WB and the block is dropped again.
+ */
+static int zram_writeback_page(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, u32 now, struct page *page)
+{
+	int ret = 0;
+	unsigned long blk;
+	struct zram_stream *strm;
+
+	strm = zram_get_stream(zram);
+	mutex_lock(&zram->lock);
+	zram_slot_lock(zram, index);
+
+	if (!zram_wb_eligible(zram, index, mode, now)) {
+		blk = 0;
+		goto out_unlock;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	blk = zram_alloc_block(zram);
+	if (!blk) {
+		ret = -ENOSPC;
+		goto out_unlock;
+	}
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		void *src, *dst;
 
-		page = bvec->bv_page;
+		dst = kmap_atomic(page, KM_USER0);
+		src = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER1);
+		kunmap_atomic(dst, KM_USER0);
+	} else {
+		ret = zram_decompress_page(zram, strm, index, page);
+	}
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			/* Do nothing */
-			index++;
-			continue;
+out_unlock:
+	zram_slot_unlock(zram, index);
+	mutex_unlock(&zram->lock);
+	zram_put_stream(strm);
+
+	if (!blk || ret)
+		goto out;
+
+	ret = zram_bdev_rw(zram, WRITE_SYNC, page, blk);
+
+	mutex_lock(&zram->lock);
+	zram_slot_lock(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		if (!ret) {
+			zram_free_page(zram, index);
+			zram->table[index].bd_block = blk;
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram_stat_inc(&zram->stats.bd_count);
+			blk = 0;
 		}
+	}
+	zram_slot_unlock(zram, index);
+	mutex_unlock(&zram->lock);
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
+	if (!ret)
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+out:
+	if (blk)
+		zram_free_block(zram, blk);
+	return ret;
+}
+
+/**
+ * zram_writeback - move pages to the backing device
+ * @zram: device, with a backing device set
+ * @mode: which pages to write back
+ *
+ * Pages on the backing device take no memory, and are read from it until
+ * overwritten or freed.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	u32 index, now = get_seconds();
+	struct page *page;
+
+	/* Keeps the device from being reset under us */
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		ret = zram_writeback_page(zram, index, mode, now, page);
+		if (ret)
+			break;
+		cond_resched();
+	}
+
+	__free_page(page);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+static void zram_release_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->bd_bitmap);
+	kfree(zram->backing_dev);
+
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_nr_blocks = 0;
+	zram->backing_dev = NULL;
+}
+
+/**
+ * zram_set_backing_dev - set the block device for writeback
+ * @zram: device, not initialized
+ * @path: block device path, or "none" to remove it
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *name = NULL;
+	unsigned long nr_blocks = 0, *bitmap = NULL;
+	struct block_device *bdev = NULL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (!strcmp(path, "none"))
+		goto set;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		bdev = NULL;
+		goto out;
+	}
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto out;
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = -ENOMEM;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	name = kstrdup(path, GFP_KERNEL);
+	if (!bitmap || !name)
+		goto out;
+
+set:
+	zram_release_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->bd_bitmap = bitmap;
+	zram->bd_nr_blocks = nr_blocks;
+	zram->backing_dev = name;
+	mutex_unlock(&zram->init_lock);
+
+	if (bdev)
+		pr_info("Using %s as backing device (%lu pages)\n",
+			path, nr_blocks);
+	return 0;
+
+out:
+	mutex_unlock(&zram->init_lock);
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(bitmap);
+	kfree(name);
+	return ret;
+}
+
+/*
+ * Reads one page. The slot lock keeps the entry from being freed or
+ * replaced while its data is copied out; it is dropped for the zero, same
+ * and backing device cases, which need nothing from the entry after.
+ */
+static int zram_read_page(struct zram *zram, u32 index, struct page *page,
+			u32 now)
+{
+	int ret = 0;
+	unsigned long element, blk;
+	struct zram_stream *strm = NULL;
+
+retry:
+	zram_slot_lock(zram, index);
+	zram->table[index].ac_time = now;
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_slot_unlock(zram, index);
+		handle_zero_page(page);
+		goto out;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		element = zram->table[index].element;
+		zram_slot_unlock(zram, index);
+		handle_same_page(page, element);
+		goto out;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk = zram->table[index].bd_block;
+		zram_slot_unlock(zram, index);
+		ret = zram_read_from_bdev(zram, page, blk);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+				"page=%u\n", ret, index);
+			goto out;
 		}
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+		flush_dcache_page(page);
+		goto out;
+	}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		zram_slot_unlock(zram, index);
+		pr_debug("Read before write: page=%u\n", index);
+		/* Do nothing */
+		goto out;
+	}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		zram_slot_unlock(zram, index);
+		goto out;
+	}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	/* Getting a stream may sleep, so not under the slot lock */
+	if (!strm) {
+		zram_slot_unlock(zram, index);
+		strm = zram_get_stream(zram);
+		goto retry;
+	}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+	ret = zram_decompress_page(zram, strm, index, page);
+	zram_slot_unlock(zram, index);
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		goto out;
+	}
+
+	flush_dcache_page(page);
+out:
+	if (strm)
+		zram_put_stream(strm);
+	return ret;
+}
+
+static int zram_read(struct zram *zram, struct bio *bio)
+{
+
+	int i;
+	u32 index, now = get_seconds();
+	struct bio_vec *bvec;
+
+	if (unlikely(!zram->init_done)) {
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	zram_stat64_inc(zram, &zram->stats.num_reads);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (unlikely(zram_read_page(zram, index, bvec->bv_page,
+				now))) {
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
-
-		flush_dcache_page(page);
 		index++;
 	}
 
@@ -285,7 +910,7 @@ out:
 static int zram_write(struct zram *zram, struct bio *bio)
 {
 	int i, ret;
-	u32 index;
+	u32 index, now;
 	struct bio_vec *bvec;
 
 	if (unlikely(!zram->init_done)) {
@@ -295,50 +920,71 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	}
 
 	zram_stat64_inc(zram, &zram->stats.num_writes);
+	now = get_seconds();
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		u32 hash = 0;
+		int shared, added;
+		u64 start;
+		unsigned long element, handle;
+		unsigned int clen;
+		struct page *page, *page_store = NULL;
+		struct zram_stream *strm;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
+			mutex_lock(&zram->lock);
+			zram_slot_lock(zram, index);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			if (zram->table[index].handle ||
+					zram_test_flag(zram, index, ZRAM_ZERO))
+				zram_free_page(zram, index);
+			if (!element) {
+				zram_stat_inc(&zram->stats.pages_zero);
+				zram_set_flag(zram, index, ZRAM_ZERO);
+			} else {
+				zram_stat_inc(&zram->stats.pages_same);
+				zram_set_flag(zram, index, ZRAM_SAME);
+				zram->table[index].element = element;
+			}
+			zram->table[index].ac_time = now;
+			zram_slot_unlock(zram, index);
 			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
 			index++;
 			continue;
 		}
+		kunmap_atomic(user_mem, KM_USER0);
+
+		/* Only the table and pool updates need zram->lock */
+		strm = zram_get_stream(zram);
+		src = strm->buffer;
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		/* buffer is two pages, room for expanding output */
+		clen = 2 * PAGE_SIZE;
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		start = local_clock();
+		ret = crypto_comp_compress(strm->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_put_stream(strm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
+		zram_stat_compress(zram, clen, local_clock() - start);
+
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
@@ -348,60 +994,91 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zram_put_stream(strm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
 					&zram->stats.failed_writes);
 				goto out;
 			}
-
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+		} else if (zram->dedup_enable) {
+			hash = jhash(src, clen, 0);
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+		mutex_lock(&zram->lock);
 
-memstore:
-		zram->table[index].offset = offset;
+		/*
+		 * Prepare the new data first, the slot lock is only held to
+		 * swap it in as allocating may sleep.
+		 */
+		shared = added = 0;
+		if (unlikely(page_store)) {
+			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+		} else if (zram->dedup_enable && (handle =
+				zram_dedup_get(zram, hash, src, clen))) {
+			shared = 1;
+		} else {
+			handle = zs_malloc(zram->mem_pool, clen);
+			if (!handle) {
+				mutex_unlock(&zram->lock);
+				zram_put_stream(strm);
+				pr_info("Error allocating memory for "
+					"compressed page: %u, size=%u\n",
+					index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+			cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+			memcpy(cmem, src, clen);
+			zs_unmap_object(zram->mem_pool, handle);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+			if (zram->dedup_enable)
+				added = zram_dedup_add(zram, handle, clen,
+						hash);
 		}
-#endif
 
-		memcpy(cmem, src, clen);
+		zram_slot_lock(zram, index);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		if (zram->table[index].handle ||
+				zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_free_page(zram, index);
+
+		if (unlikely(page_store)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram->table[index].page = page_store;
+		} else {
+			zram->table[index].handle = handle;
+			if (shared || added)
+				zram_set_flag(zram, index, ZRAM_DEDUP);
+		}
+		zram->table[index].size = clen;
+		zram->table[index].ac_time = now;
+		zram_slot_unlock(zram, index);
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+		if (shared) {
+			zram_stat_inc(&zram->stats.pages_dedup);
+		} else {
+			if (page_store)
+				zram_stat_inc(&zram->stats.pages_expand);
+			zram_stat64_add(zram, &zram->stats.compr_size, clen);
+			if (clen <= PAGE_SIZE / 2)
+				zram_stat_inc(&zram->stats.good_compress);
+		}
 
 		mutex_unlock(&zram->lock);
+		zram_put_stream(strm);
 		index++;
 	}
 
@@ -458,6 +1135,61 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void zram_destroy_streams(struct zram *zram)
+{
+	struct zram_stream *strm;
+	int cpu;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(zram->streams, cpu);
+		if (strm->tfm)
+			crypto_free_comp(strm->tfm);
+		free_pages((unsigned long)strm->buffer, 1);
+	}
+
+	free_percpu(zram->streams);
+	zram->streams = NULL;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	struct zram_stream *strm;
+	int cpu;
+
+	zram->streams = alloc_percpu(struct zram_stream);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(zram->streams, cpu);
+		mutex_init(&strm->lock);
+
+		strm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(strm->tfm)) {
+			pr_err("Error allocating compressor %s: err=%ld\n",
+				zram->compressor, PTR_ERR(strm->tfm));
+			strm->tfm = NULL;
+			goto fail;
+		}
+
+		/* compressed data may expand beyond PAGE_SIZE */
+		strm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!strm->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	zram_destroy_streams(zram);
+	return -ENOMEM;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -466,33 +1198,32 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_destroy_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle = zram->table[index].handle;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		/* Shared objects are freed with the dedup tree */
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+				zram_test_flag(zram, index, ZRAM_DEDUP) ||
+				zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
+	zram_dedup_destroy(zram);
+	zram_release_backing_dev(zram);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -516,19 +1247,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret)
 		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
@@ -545,7 +1266,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -571,7 +1292,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -587,6 +1310,11 @@ static int create_device(struct zram *zram, int device_id)
 	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	spin_lock_init(&zram->bd_lock);
+	zram->wb_idle_age = default_wb_idle_age;
+	zram->dedup_tree = RB_ROOT;
+	strcpy(zram->compressor, default_compressor);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -721,6 +1449,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_release_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -17,8 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/rbtree.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +28,17 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default crypto API compressor, can be changed through sysfs */
+static const char default_compressor[] = "lzo";
+
+/* Pages not accessed for this long (seconds) are idle for writeback */
+static const unsigned default_wb_idle_age = 60 * 60;
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +47,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -70,6 +66,21 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one repeated word, kept in table[page_no].element */
+	ZRAM_SAME,
+
+	/* Object may be shared with other pages, see struct zram_dedup */
+	ZRAM_DEDUP,
+
+	/* Page is on the backing device, at table[page_no].bd_block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Bit spinlock of the entry, see zram_slot_lock() */
+	ZRAM_LOCK,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -77,10 +88,16 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED pages */
+		unsigned long element;	/* ZRAM_SAME pages */
+		unsigned long bd_block;	/* ZRAM_WB pages */
+	};
+	unsigned long flags;	/* zram_pageflags, a bit_spinlock word */
+	u32 ac_time;	/* last access, in seconds */
+	u16 size;	/* compressed size */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -95,16 +112,53 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_same;		/* no. of pages filled with a non-zero word */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u32 bd_count;		/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	/* compressor performance, for the algorithm in use */
+	u64 compr_pages;	/* no. of pages passed to the compressor */
+	u64 compr_out;		/* compressor output, bytes */
+	u64 compr_ns;		/* time spent compressing */
+	u64 decompr_pages;	/* no. of pages decompressed */
+	u64 decompr_ns;		/* time spent decompressing */
+};
+
+/*
+ * Compressor transform and output buffer. There is one per possible CPU
+ * so that requests on different CPUs (de)compress in parallel.
+ */
+struct zram_stream {
+	struct mutex lock;	/* a task that migrated may still use it */
+	struct crypto_comp *tfm;
+	void *buffer;
+};
+
+/*
+ * With dedup enabled, every compressed object gets one of these, keyed by
+ * a hash of its contents. Pages whose compressed data matches an existing
+ * object point their table entry at it and take a reference instead of
+ * allocating.
+ */
+struct zram_dedup {
+	struct rb_node node;
+	u32 hash;
+	u32 refcount;
+	unsigned long handle;
+	u16 size;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_stream __percpu *streams;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	struct mutex lock;	/* protect table and mem_pool updates
+				 * against concurrent writes */
+	struct rb_root dedup_tree;	/* zram_dedup by (hash, handle) */
+	spinlock_t dedup_lock;	/* protect dedup_tree and refcounts */
+	int dedup_enable;	/* fixed while the device is initialized */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -115,6 +169,16 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto API compressor, fixed while the device is initialized */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+
+	/* Optional backing device for pages written back */
+	struct block_device *bdev;
+	char *backing_dev;		/* its path */
+	unsigned long *bd_bitmap;	/* blocks in use, block 0 unused */
+	unsigned long bd_nr_blocks;
+	spinlock_t bd_lock;		/* protect bd_bitmap */
+	unsigned int wb_idle_age;	/* seconds, for ZRAM_WB_IDLE */
 
 	struct zram_stats stats;
 };
@@ -125,7 +189,15 @@ extern unsigned int num_devices;
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
+/* Which pages zram_writeback() writes to the backing device */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages not accessed for wb_idle_age */
+};
+
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
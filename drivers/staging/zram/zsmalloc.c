@@ -0,0 +1,719 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped in size classes. Each class allocates from zspages:
+ * up to ZS_MAX_PAGES_PER_ZSPAGE pages treated as one contiguous area and
+ * cut into objects of the class size, which may cross page boundaries.
+ *
+ * Callers get an opaque handle instead of an address. Objects are mapped
+ * for access with zs_map_object(), and can be moved in between. This lets
+ * zs_compact() migrate objects out of sparsely used zspages and free them,
+ * so the pool shrinks back after a burst of allocations is freed.
+ */
+
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Handles are words from this cache, shared by all pools */
+static struct kmem_cache *handle_cachep;
+static int handle_cache_users;
+static DEFINE_MUTEX(handle_cache_lock);
+
+static int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/* Number of pages per zspage that wastes the least at the end */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usedpc;
+
+		usedpc = (zspage_size - zspage_size % size) * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void pin_handle(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_handle(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_handle(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle >> 1;
+}
+
+/* Handle must be pinned, or not yet visible to anyone else */
+static void record_obj(unsigned long handle, unsigned long obj, int pinned)
+{
+	*(unsigned long *)handle = obj << 1 | (pinned ? 1 : 0);
+}
+
+static unsigned long location_to_obj(struct zspage *zspage, unsigned int idx)
+{
+	return page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS | idx;
+}
+
+static void obj_to_location(unsigned long obj, struct zspage **zspage,
+				unsigned int *idx)
+{
+	struct page *page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+
+	*zspage = (struct zspage *)page_private(page);
+	*idx = obj & OBJ_INDEX_MASK;
+}
+
+/* Object header word, at most ZS_HANDLE_SIZE so it never spans pages */
+static unsigned long read_obj_header(struct size_class *class,
+				struct zspage *zspage, unsigned int idx)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	unsigned long *addr, val;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER0);
+	val = *(unsigned long *)((char *)addr + (off & ~PAGE_MASK));
+	kunmap_atomic(addr, KM_USER0);
+
+	return val;
+}
+
+static void write_obj_header(struct size_class *class,
+			struct zspage *zspage, unsigned int idx,
+			unsigned long val)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	unsigned long *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER0);
+	*(unsigned long *)((char *)addr + (off & ~PAGE_MASK)) = val;
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/*
+ * Copies len bytes between buf and a zspage, starting at offset off into
+ * the zspage and crossing page boundaries as needed.
+ */
+static void zspage_copy(struct zspage *zspage, unsigned long off,
+			char *buf, unsigned int len, int to_zspage)
+{
+	while (len) {
+		unsigned int poff = off & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - poff);
+		char *addr;
+
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER0);
+		if (to_zspage)
+			memcpy(addr + poff, buf, n);
+		else
+			memcpy(buf, addr + poff, n);
+		kunmap_atomic(addr, KM_USER0);
+
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void zspage_move(struct zspage *dst, unsigned long doff,
+			struct zspage *src, unsigned long soff,
+			unsigned int len)
+{
+	while (len) {
+		unsigned int dpoff = doff & ~PAGE_MASK;
+		unsigned int spoff = soff & ~PAGE_MASK;
+		unsigned int n = min3(len, (unsigned int)PAGE_SIZE - dpoff,
+					(unsigned int)PAGE_SIZE - spoff);
+		char *saddr, *daddr;
+
+		saddr = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		daddr = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(daddr + dpoff, saddr + spoff, n);
+		kunmap_atomic(daddr, KM_USER1);
+		kunmap_atomic(saddr, KM_USER0);
+
+		doff += n;
+		soff += n;
+		len -= n;
+	}
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * ZS_ALMOST_EMPTY_FRAC <=
+			class->objs_per_zspage * (ZS_ALMOST_EMPTY_FRAC - 1))
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage,
+			enum fullness_group fullness)
+{
+	zspage->fullness = fullness;
+	list_add(&zspage->list, &class->fullness_list[fullness]);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class, int index)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = index;
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(pool->flags);
+
+		if (!page)
+			goto fail;
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+		zspage->nr_pages++;
+	}
+
+	/* Chain all objects on the free list */
+	for (i = 0; i < class->objs_per_zspage; i++)
+		write_obj_header(class, zspage, i, (unsigned long)(i + 1) << 1);
+
+	atomic_long_add(zspage->nr_pages, &pool->pages_allocated);
+	return zspage;
+
+fail:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < zspage->nr_pages; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+
+	class->objs_allocated -= class->objs_per_zspage;
+	atomic_long_sub(zspage->nr_pages, &pool->pages_allocated);
+	kfree(zspage);
+}
+
+/* Moves zspage to the list matching its use, frees it when empty */
+static void fix_fullness_group(struct zs_pool *pool, struct size_class *class,
+				struct zspage *zspage)
+{
+	enum fullness_group fullness;
+
+	/* Compaction puts it back when done */
+	if (zspage->isolated)
+		return;
+
+	fullness = get_fullness_group(class, zspage);
+	if (fullness == zspage->fullness)
+		return;
+
+	list_del(&zspage->list);
+	if (fullness == ZS_EMPTY)
+		free_zspage(pool, class, zspage);
+	else
+		insert_zspage(class, zspage, fullness);
+}
+
+static unsigned long obj_malloc(struct size_class *class,
+				struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx = zspage->freeidx;
+
+	zspage->freeidx = read_obj_header(class, zspage, idx) >> 1;
+	write_obj_header(class, zspage, idx, handle | OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return location_to_obj(zspage, idx);
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	write_obj_header(class, zspage, idx,
+			(unsigned long)zspage->freeidx << 1);
+	zspage->freeidx = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/* A zspage with free objects, fullest first to keep others emptying */
+static struct zspage *find_free_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+
+	return list_first_entry(head, struct zspage, list);
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: object size, at most ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ *
+ * Returns a handle to the object, or 0 on failure. The object has to be
+ * mapped with zs_map_object() to be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	int index;
+	unsigned long handle, obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(handle_cachep,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	index = get_size_class_index(size + ZS_HANDLE_SIZE);
+	class = &pool->classes[index];
+
+	spin_lock(&class->lock);
+	zspage = find_free_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, index);
+		if (!zspage) {
+			kmem_cache_free(handle_cachep, (void *)handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->objs_allocated += class->objs_per_zspage;
+		insert_zspage(class, zspage, ZS_ALMOST_EMPTY);
+	}
+
+	obj = obj_malloc(class, zspage, handle);
+	record_obj(handle, obj, 0);
+	fix_fullness_group(pool, class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Pinned, the object cannot move under us */
+	pin_handle(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = &pool->classes[zspage->class];
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, idx);
+	fix_fullness_group(pool, class, zspage);
+	spin_unlock(&class->lock);
+
+	unpin_handle(handle);
+	kmem_cache_free(handle_cachep, (void *)handle);
+}
+
+/**
+ * zs_map_object - get the address of an object
+ * @pool: pool the object belongs to
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * Objects within one page are kmapped, others are copied into a per-CPU
+ * buffer (and back at unmap, unless mapped read only). The object cannot
+ * move until zs_unmap_object(), and the caller must not sleep in between.
+ * Only one object can be mapped at a time on a CPU. Mapping and unmapping
+ * use KM_USER0 and KM_USER1 themselves, so a caller that also kmaps a page
+ * must do so after this and undo it before zs_unmap_object().
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned int idx;
+	unsigned long off;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	/* Also disables preemption, which keeps us on this area */
+	pin_handle(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = &pool->classes[zspage->class];
+	off = (unsigned long)idx * class->size;
+
+	area = this_cpu_ptr(pool->area);
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					KM_USER1);
+		return area->addr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	area->addr = NULL;
+	if (mm != ZS_MM_WO)
+		zspage_copy(zspage, off + ZS_HANDLE_SIZE, area->buf,
+			class->size - ZS_HANDLE_SIZE, 0);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	area = this_cpu_ptr(pool->area);
+	if (area->addr) {
+		kunmap_atomic(area->addr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		obj_to_location(handle_to_obj(handle), &zspage, &idx);
+		class = &pool->classes[zspage->class];
+		zspage_copy(zspage,
+			(unsigned long)idx * class->size + ZS_HANDLE_SIZE,
+			area->buf, class->size - ZS_HANDLE_SIZE, 1);
+	}
+
+	unpin_handle(handle);
+}
+
+/*
+ * Moves the objects of src to other zspages of the class. Returns -ENOSPC
+ * when no other zspage has room left.
+ */
+static int migrate_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src)
+{
+	unsigned int idx;
+	unsigned long hdr, handle, obj;
+	struct zspage *dst;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		hdr = read_obj_header(class, src, idx);
+		if (!(hdr & OBJ_ALLOCATED_TAG))
+			continue;
+
+		/* Mapped or being freed, leave it */
+		handle = hdr & ~OBJ_ALLOCATED_TAG;
+		if (!trypin_handle(handle))
+			continue;
+
+		dst = find_free_zspage(class);
+		if (!dst) {
+			unpin_handle(handle);
+			return -ENOSPC;
+		}
+
+		/* obj_malloc() wrote the header, copy the rest */
+		obj = obj_malloc(class, dst, handle);
+		zspage_move(dst,
+			(obj & OBJ_INDEX_MASK) * class->size + ZS_HANDLE_SIZE,
+			src, (unsigned long)idx * class->size + ZS_HANDLE_SIZE,
+			class->size - ZS_HANDLE_SIZE);
+		record_obj(handle, obj, 1);
+		obj_free(class, src, idx);
+		fix_fullness_group(pool, class, dst);
+
+		unpin_handle(handle);
+	}
+
+	return 0;
+}
+
+/* Enough free objects in the class to empty at least one zspage */
+static int zs_can_compact(struct size_class *class)
+{
+	return class->objs_allocated - class->objs_inuse >=
+		class->objs_per_zspage;
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	int ret = 0;
+	unsigned long freed = 0;
+	struct zspage *src, *tmp;
+	LIST_HEAD(done);
+
+	spin_lock(&class->lock);
+	while (!ret && zs_can_compact(class)) {
+		struct list_head *head = &class->fullness_list[ZS_ALMOST_EMPTY];
+
+		if (list_empty(head))
+			break;
+
+		/* Isolated, so it is not picked as a destination */
+		src = list_first_entry(head, struct zspage, list);
+		list_del(&src->list);
+		src->isolated = 1;
+
+		ret = migrate_zspage(pool, class, src);
+		if (!src->inuse) {
+			freed += src->nr_pages;
+			free_zspage(pool, class, src);
+		} else {
+			list_add(&src->list, &done);
+		}
+
+		cond_resched_lock(&class->lock);
+	}
+
+	/* Put back what could not be emptied, or was freed to meanwhile */
+	list_for_each_entry_safe(src, tmp, &done, list) {
+		list_del(&src->list);
+		src->isolated = 0;
+		if (!src->inuse) {
+			freed += src->nr_pages;
+			free_zspage(pool, class, src);
+		} else {
+			insert_zspage(class, src,
+				get_fullness_group(class, src));
+		}
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - free sparsely used zspages by migrating their objects
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. Runs from the pool shrinker under
+ * memory pressure, and may be called directly.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->classes[i];
+
+		if (class->objs_per_zspage < 2)
+			continue;
+		freed += compact_class(pool, class);
+	}
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+static int zs_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	int i;
+	unsigned long pages = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	if (nr_to_scan)
+		zs_compact(pool);
+
+	/* Pages compaction could still free, roughly */
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		if (class->objs_per_zspage < 2)
+			continue;
+		pages += (class->objs_allocated - class->objs_inuse) /
+			class->objs_per_zspage * class->pages_per_zspage;
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+static void destroy_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->area, cpu)->buf);
+	free_percpu(pool->area);
+}
+
+static int get_handle_cache(void)
+{
+	int ret = 0;
+
+	mutex_lock(&handle_cache_lock);
+	if (!handle_cache_users) {
+		handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+						0, 0, NULL);
+		if (!handle_cachep)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		handle_cache_users++;
+	mutex_unlock(&handle_cache_lock);
+
+	return ret;
+}
+
+static void put_handle_cache(void)
+{
+	mutex_lock(&handle_cache_lock);
+	if (!--handle_cache_users) {
+		kmem_cache_destroy(handle_cachep);
+		handle_cachep = NULL;
+	}
+	mutex_unlock(&handle_cache_lock);
+}
+
+/**
+ * zs_create_pool - create a pool of objects
+ * @name: pool name, for messages
+ * @flags: allocation flags for the pool pages, __GFP_HIGHMEM is fine
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i, j, cpu;
+	struct zs_pool *pool;
+
+	pool = vzalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		for (j = 0; j < __NR_ZS_FULLNESS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					class->size;
+	}
+
+	pool->area = alloc_percpu(struct mapping_area);
+	if (!pool->area)
+		goto fail_pool;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = per_cpu_ptr(pool->area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail_area;
+	}
+
+	if (get_handle_cache())
+		goto fail_area;
+
+	pool->flags = flags;
+	pool->name = name;
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+
+fail_area:
+	destroy_map_areas(pool);
+fail_pool:
+	vfree(pool);
+	return NULL;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, j;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		for (j = 0; j < __NR_ZS_FULLNESS; j++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[j], list) {
+				pr_info("%s: freeing zspage with %u objects "
+					"in use, class size %u\n", pool->name,
+					zspage->inuse, class->size);
+				list_del(&zspage->list);
+				free_zspage(pool, class, zspage);
+			}
+		}
+	}
+
+	destroy_map_areas(pool);
+	put_handle_cache();
+	vfree(pool);
+}
@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "zsmalloc.h"
+
+/* User configurable params */
+
+/* Size classes are ZS_SIZE_CLASS_DELTA bytes apart */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+				/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is this many pages at most. Objects are packed across the
+ * page boundaries in it, larger zspages waste less at the end.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * A zspage is almost empty, and a compaction source, while no more than
+ * 3/4 of its objects are in use.
+ */
+#define ZS_ALMOST_EMPTY_FRAC	4
+
+/* End of user params */
+
+/*
+ * Each object starts with a word holding its handle and OBJ_ALLOCATED_TAG,
+ * so compaction can find the handle to update. Free objects hold the index
+ * of the next free object there instead, shifted past the tag.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define OBJ_ALLOCATED_TAG	1UL
+
+/*
+ * A handle points to a word holding the object location, shifted past
+ * HANDLE_PIN_BIT. The location is the pfn of the first page of the zspage
+ * and the object index in it. The pin bit is held while the object is
+ * mapped or freed, compaction leaves pinned objects in place.
+ */
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS		(PAGE_SHIFT - 2)
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	__NR_ZS_FULLNESS,
+};
+
+struct zspage {
+	struct list_head list;	/* in size_class fullness list */
+	unsigned int inuse;	/* no. of objects allocated */
+	unsigned int freeidx;	/* first free object */
+	u8 class;		/* size_class index */
+	u8 fullness;		/* list it is on, if not isolated */
+	u8 isolated;		/* taken off the lists by compaction */
+	u8 nr_pages;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[__NR_ZS_FULLNESS];
+	unsigned int size;		/* object size, with handle word */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* stats */
+	unsigned long objs_allocated;	/* in all zspages, used or not */
+	unsigned long objs_inuse;
+};
+
+/* Per-CPU area for mapping objects that span two pages */
+struct mapping_area {
+	char *buf;
+	void *addr;		/* kmap address, if the object did not span */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_SIZE_CLASSES];
+	struct mapping_area __percpu *area;
+	struct shrinker shrinker;
+	gfp_t flags;
+	const char *name;
+
+	/* stats */
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
@@ -916,6 +916,7 @@ static int de_thread(struct task_struct *tsk)
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
 
+		oom_adj_notify(leader, OOM_ADJ_EXEC);
 		release_task(leader);
 	}
 
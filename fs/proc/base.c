@@ -1084,6 +1084,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(task, OOM_ADJ_CHANGE);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1219,6 +1221,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(task, OOM_ADJ_CHANGE);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -26,13 +26,26 @@
 struct squashfs_decompressor {
 	void	*(*init)(struct squashfs_sb_info *);
 	void	(*free)(void *);
-	int	(*decompress)(struct squashfs_sb_info *, void **,
+	int	(*decompress)(struct squashfs_sb_info *, void *, void **,
 		struct buffer_head **, int, int, int, int, int);
 	int	id;
 	char	*name;
 	int	supported;
 };
 
+/*
+ * How the decompressor streams of a superblock are shared by readers,
+ * chosen at mount time with the threads= option
+ */
+struct squashfs_decompressor_thread_ops {
+	void	*(*create)(struct squashfs_sb_info *);
+	void	(*destroy)(struct squashfs_sb_info *);
+	int	(*decompress)(struct squashfs_sb_info *, void **,
+		struct buffer_head **, int, int, int, int, int);
+	int	(*max_decompressors)(void);
+	char	*name;
+};
+
 static inline void *squashfs_decompressor_init(struct squashfs_sb_info *msblk)
 {
 	return msblk->decompressor->init(msblk);
@@ -45,14 +58,39 @@ static inline void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
 		msblk->decompressor->free(s);
 }
 
+static inline void *squashfs_decompressor_create(
+	struct squashfs_sb_info *msblk)
+{
+	return msblk->thread_ops->create(msblk);
+}
+
+static inline void squashfs_decompressor_destroy(
+	struct squashfs_sb_info *msblk)
+{
+	if (msblk->stream)
+		msblk->thread_ops->destroy(msblk);
+}
+
 static inline int squashfs_decompress(struct squashfs_sb_info *msblk,
 	void **buffer, struct buffer_head **bh, int b, int offset, int length,
 	int srclength, int pages)
 {
-	return msblk->decompressor->decompress(msblk, buffer, bh, b, offset,
+	return msblk->thread_ops->decompress(msblk, buffer, bh, b, offset,
 		length, srclength, pages);
 }
 
+static inline int squashfs_max_decompressors(struct squashfs_sb_info *msblk)
+{
+	return msblk->thread_ops->max_decompressors();
+}
+
+extern const struct squashfs_decompressor_thread_ops
+	squashfs_decompressor_single;
+extern const struct squashfs_decompressor_thread_ops
+	squashfs_decompressor_multi;
+extern const struct squashfs_decompressor_thread_ops
+	squashfs_decompressor_percpu;
+
 #ifdef CONFIG_SQUASHFS_XZ
 extern const struct squashfs_decompressor squashfs_xz_comp_ops;
 #endif
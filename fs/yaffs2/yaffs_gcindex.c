@@ -0,0 +1,248 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "yaffs_gcindex.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_yaffs2.h"
+#include "yaffs_trace.h"
+
+/*
+ * Garbage collection victim index.
+ *
+ * Full blocks that have some space to reclaim are kept on one list per
+ * number of pages in use (less soft deleted pages), so the dirtiest block
+ * is found without scanning block_info. Prioritised blocks are kept on
+ * one more list after those. Blocks go to the tail of a list, so within a
+ * list the block that got that dirty first is tried first.
+ *
+ * yaffs_gc_index_update() must be called whenever a block's state, pages
+ * in use, soft deleted pages or gc_prioritise change.
+ */
+
+static inline int yaffs_gc_prio_bucket(struct yaffs_dev *dev)
+{
+	return dev->param.chunks_per_block;
+}
+
+static inline struct yaffs_gc_link *yaffs_gc_link(struct yaffs_dev *dev,
+						  int blk)
+{
+	return &dev->gc_links[blk - dev->internal_start_block];
+}
+
+static inline int yaffs_gc_link_block(struct yaffs_dev *dev,
+				      struct yaffs_gc_link *link)
+{
+	return (link - dev->gc_links) + dev->internal_start_block;
+}
+
+/* The list a block belongs on, or -1 if it is not a gc victim. */
+static int yaffs_gc_bucket(struct yaffs_dev *dev, struct yaffs_block_info *bi)
+{
+	int pages_used;
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL)
+		return -1;
+
+	if (bi->gc_prioritise)
+		return yaffs_gc_prio_bucket(dev);
+
+	pages_used = bi->pages_in_use - bi->soft_del_pages;
+	if (pages_used < 0 || pages_used >= dev->param.chunks_per_block)
+		return -1;
+
+	return pages_used;
+}
+
+int yaffs_gc_index_init(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int n_buckets = yaffs_gc_prio_bucket(dev) + 1;
+	int i;
+
+	dev->gc_links =
+		kmalloc(n_blocks * sizeof(struct yaffs_gc_link), GFP_NOFS);
+	if (!dev->gc_links) {
+		dev->gc_links =
+		    vmalloc(n_blocks * sizeof(struct yaffs_gc_link));
+		dev->gc_links_alt = 1;
+	} else {
+		dev->gc_links_alt = 0;
+	}
+
+	dev->gc_buckets =
+		kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
+
+	if (!dev->gc_links || !dev->gc_buckets)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < n_buckets; i++)
+		INIT_LIST_HEAD(&dev->gc_buckets[i]);
+
+	for (i = 0; i < n_blocks; i++) {
+		INIT_LIST_HEAD(&dev->gc_links[i].list);
+		dev->gc_links[i].bucket = -1;
+	}
+
+	return YAFFS_OK;
+}
+
+void yaffs_gc_index_deinit(struct yaffs_dev *dev)
+{
+	if (dev->gc_links_alt && dev->gc_links)
+		vfree(dev->gc_links);
+	else if (dev->gc_links)
+		kfree(dev->gc_links);
+
+	dev->gc_links_alt = 0;
+	dev->gc_links = NULL;
+
+	kfree(dev->gc_buckets);
+	dev->gc_buckets = NULL;
+}
+
+void yaffs_gc_index_update(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_gc_link *link;
+	int bucket;
+
+	if (!dev->gc_links)
+		return;
+
+	link = yaffs_gc_link(dev, blk);
+	bucket = yaffs_gc_bucket(dev, yaffs_get_block_info(dev, blk));
+
+	if (bucket == link->bucket)
+		return;
+
+	list_del_init(&link->list);
+	link->bucket = bucket;
+
+	if (bucket < 0)
+		return;
+
+	list_add_tail(&link->list, &dev->gc_buckets[bucket]);
+
+	/* A prioritised block may only now have become full */
+	if (bucket == yaffs_gc_prio_bucket(dev))
+		dev->has_pending_prioritised_gc = 1;
+}
+
+/* File every block afresh, after scanning or restoring a checkpoint. */
+void yaffs_gc_index_rebuild(struct yaffs_dev *dev)
+{
+	int i;
+
+	if (!dev->gc_links)
+		return;
+
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		yaffs_gc_index_update(dev, i);
+}
+
+/*
+ * Check a block is on the list it should be on. One that is not missed an
+ * update, so log it and refile it.
+ */
+static int yaffs_gc_check_filed(struct yaffs_dev *dev,
+				struct yaffs_gc_link *link)
+{
+	int blk = yaffs_gc_link_block(dev, link);
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+
+	if (yaffs_gc_bucket(dev, bi) == link->bucket)
+		return 1;
+
+	yaffs_trace(YAFFS_TRACE_ERROR,
+		"GC index: block %d misfiled in %d state %d in use %d",
+		blk, link->bucket, bi->block_state,
+		bi->pages_in_use - bi->soft_del_pages);
+
+	yaffs_gc_index_update(dev, blk);
+	return 0;
+}
+
+/*
+ * Find the dirtiest block that can be collected, with at most max_in_use
+ * pages in use. Returns 0 if there is none.
+ */
+int yaffs_gc_index_find(struct yaffs_dev *dev, int max_in_use)
+{
+	struct yaffs_gc_link *link;
+	struct yaffs_gc_link *next;
+	struct yaffs_block_info *bi;
+	int prio = yaffs_gc_prio_bucket(dev);
+	int best = 0;
+	int best_in_use = max_in_use + 1;
+	int pages_used;
+	int b;
+
+	if (!dev->gc_links)
+		return 0;
+
+	/* Prioritised blocks compete on dirtiness here too */
+	list_for_each_entry_safe(link, next, &dev->gc_buckets[prio], list) {
+		if (!yaffs_gc_check_filed(dev, link))
+			continue;
+
+		bi = yaffs_get_block_info(dev, yaffs_gc_link_block(dev, link));
+		pages_used = bi->pages_in_use - bi->soft_del_pages;
+
+		if (pages_used < best_in_use &&
+		    yaffs_block_ok_for_gc(dev, bi)) {
+			best = yaffs_gc_link_block(dev, link);
+			best_in_use = pages_used;
+		}
+	}
+
+	for (b = 0; b < best_in_use && b < prio; b++) {
+		list_for_each_entry_safe(link, next, &dev->gc_buckets[b],
+					 list) {
+			if (!yaffs_gc_check_filed(dev, link))
+				continue;
+
+			bi = yaffs_get_block_info(dev,
+					yaffs_gc_link_block(dev, link));
+			if (yaffs_block_ok_for_gc(dev, bi))
+				return yaffs_gc_link_block(dev, link);
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Find a prioritised block that can be collected, however full it is.
+ * Returns 0 if there is none, and sets prioritised_exist if there are
+ * prioritised blocks at all.
+ */
+int yaffs_gc_index_find_prioritised(struct yaffs_dev *dev,
+				    int *prioritised_exist)
+{
+	struct yaffs_gc_link *link;
+	struct yaffs_gc_link *next;
+	struct yaffs_block_info *bi;
+	int prio = yaffs_gc_prio_bucket(dev);
+
+	*prioritised_exist = 0;
+
+	if (!dev->gc_links)
+		return 0;
+
+	list_for_each_entry_safe(link, next, &dev->gc_buckets[prio], list) {
+		if (!yaffs_gc_check_filed(dev, link))
+			continue;
+
+		*prioritised_exist = 1;
+		bi = yaffs_get_block_info(dev, yaffs_gc_link_block(dev, link));
+		if (yaffs_block_ok_for_gc(dev, bi))
+			return yaffs_gc_link_block(dev, link);
+	}
+
+	return 0;
+}
@@ -25,6 +25,7 @@
 #include "yaffs_yaffs1.h"
 #include "yaffs_yaffs2.h"
 #include "yaffs_bitmap.h"
+#include "yaffs_gcindex.h"
 #include "yaffs_verify.h"
 
 #include "yaffs_nand.h"
@@ -35,8 +36,6 @@
 
 #include "yaffs_attribs.h"
 
-/* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
-#define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
 #include "yaffs_ecc.h"
@@ -45,6 +44,7 @@
 
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 * buffer, int n_bytes, int use_reserve);
+static void yaffs_check_obj_details_loaded(struct yaffs_obj *in);
 
 
 
@@ -259,6 +259,8 @@ void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 		bi->gc_prioritise = 1;
 		dev->has_pending_prioritised_gc = 1;
 		bi->chunk_error_strikes++;
+		yaffs_gc_index_update(dev, (bi - dev->block_info) +
+				      dev->internal_start_block);
 
 		if (bi->chunk_error_strikes > 3) {
 			bi->needs_retiring = 1;	/* Too many stikes, so retire this */
@@ -294,12 +296,12 @@ static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
 
 /*
  *  Simple hash function. Needs to have a reasonable spread
+ *  n_obj_buckets is a power of 2.
  */
 
-static inline int yaffs_hash_fn(int n)
+static inline int yaffs_hash_fn(struct yaffs_dev *dev, u32 n)
 {
-	n = abs(n);
-	return n % YAFFS_NOBJECT_BUCKETS;
+	return n & (dev->n_obj_buckets - 1);
 }
 
 /*
@@ -477,6 +479,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -515,6 +518,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		    yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -662,15 +666,19 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_index_update(dev, flash_block);
 
 	dev->n_retired_blocks++;
 }
 
 /*---------------- Name handling functions ------------*/
 
+/* Only kept in RAM, so this is free to be a proper hash rather than a sum.
+ * Names like "img_0001.jpg" need to spread over the name index buckets.
+ */
 static u16 yaffs_calc_name_sum(const YCHAR * name)
 {
-	u16 sum = 0;
+	u32 sum = 0;
 	u16 i = 1;
 
 	const YUCHAR *bname = (const YUCHAR *)name;
@@ -678,12 +686,88 @@ static u16 yaffs_calc_name_sum(const YCHAR * name)
 		while ((*bname) && (i < (YAFFS_MAX_NAME_LENGTH / 2))) {
 
 			/* 0x1f mask is case insensitive */
-			sum += ((*bname) & 0x1f) * i;
+			sum = sum * 31 + ((*bname) & 0x1f);
 			i++;
 			bname++;
 		}
 	}
-	return sum;
+	return (u16) (sum ^ (sum >> 16));
+}
+
+static void yaffs_name_index_del(struct yaffs_obj *obj)
+{
+	if (!list_empty(&obj->name_link)) {
+		list_del_init(&obj->name_link);
+		obj->parent->variant.dir_variant.name_index->n_named--;
+	}
+}
+
+static void yaffs_drop_name_index(struct yaffs_obj *dir)
+{
+	struct yaffs_name_index *ni = dir->variant.dir_variant.name_index;
+	struct list_head *i;
+	struct yaffs_obj *l;
+
+	if (!ni)
+		return;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+		list_del_init(&l->name_link);
+	}
+
+	kfree(ni);
+	dir->variant.dir_variant.name_index = NULL;
+}
+
+static void yaffs_name_index_add(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	struct yaffs_name_index *ni = dir->variant.dir_variant.name_index;
+
+	/* lost+found is matched by its fixed name, not its sum */
+	if (!ni || obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return;
+
+	if (ni->n_named >= ni->n_buckets * YAFFS_NAME_INDEX_LOAD &&
+	    ni->n_buckets < YAFFS_NAME_INDEX_MAX_BUCKETS) {
+		/* Outgrown. The next lookup builds a bigger one. */
+		yaffs_drop_name_index(dir);
+		return;
+	}
+
+	/* The sum is not valid until the name is loaded */
+	yaffs_check_obj_details_loaded(obj);
+
+	list_add(&obj->name_link, &ni->bucket[obj->sum & (ni->n_buckets - 1)]);
+	ni->n_named++;
+}
+
+static void yaffs_build_name_index(struct yaffs_obj *dir, int n_children)
+{
+	struct yaffs_name_index *ni;
+	struct list_head *i;
+	int n_buckets = 16;
+	int b;
+
+	while (n_buckets < n_children / 2 &&
+	       n_buckets < YAFFS_NAME_INDEX_MAX_BUCKETS)
+		n_buckets <<= 1;
+
+	ni = kmalloc(sizeof(struct yaffs_name_index) +
+		     n_buckets * sizeof(struct list_head), GFP_NOFS);
+	if (!ni)
+		return;		/* Just keep walking the children */
+
+	ni->n_buckets = n_buckets;
+	ni->n_named = 0;
+	for (b = 0; b < n_buckets; b++)
+		INIT_LIST_HEAD(&ni->bucket[b]);
+
+	dir->variant.dir_variant.name_index = ni;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_name_index_add(dir,
+				     list_entry(i, struct yaffs_obj, siblings));
 }
 
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
@@ -698,6 +782,12 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 		obj->short_name[0] = _Y('\0');
 #endif
 	obj->sum = yaffs_calc_name_sum(name);
+
+	/* Rehash it if it is in its parent's name index */
+	if (!list_empty(&obj->name_link)) {
+		yaffs_name_index_del(obj);
+		yaffs_name_index_add(obj->parent, obj);
+	}
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -742,8 +832,48 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 	dev->checkpoint_blocks_required = 0;	/* force recalculation */
 }
 
+static void yaffs_free_obj_hash(struct yaffs_dev *dev)
+{
+	if (dev->obj_bucket && dev->obj_bucket != dev->obj_bucket_base) {
+		if (dev->obj_bucket_alt)
+			vfree(dev->obj_bucket);
+		else
+			kfree(dev->obj_bucket);
+	}
+	dev->obj_bucket = dev->obj_bucket_base;
+	dev->obj_bucket_alt = 0;
+}
+
+static void yaffs_init_obj_hash(struct yaffs_dev *dev)
+{
+	int i;
+
+	yaffs_free_obj_hash(dev);
+	dev->n_obj_buckets = YAFFS_NOBJECT_BUCKETS;
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
+		dev->obj_bucket[i].count = 0;
+	}
+}
+
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	int i;
+	struct list_head *lh;
+	struct yaffs_obj *obj;
+
+	/* The objects go with the allocator, their name indexes don't */
+	for (i = 0; i < dev->n_obj_buckets; i++) {
+		list_for_each(lh, &dev->obj_bucket[i].list) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY) {
+				kfree(obj->variant.dir_variant.name_index);
+				obj->variant.dir_variant.name_index = NULL;
+			}
+		}
+	}
+	yaffs_init_obj_hash(dev);
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -1201,6 +1331,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_index_update(dev, block_no);
 	}
 }
 
@@ -1281,6 +1412,7 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	yaffs_name_index_del(obj);
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
@@ -1315,6 +1447,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_name_index_add(directory, obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1394,10 +1527,53 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   There are 10 to YAFFS_MAX_SHORT_OP_CACHES cache chunks per device,
+ *   sized to the device at mount. Chunks in use are hashed by object and
+ *   chunk id, so the lookup done on every short op does not have to scan
+ *   them all.
  */
 
+static void yaffs_cache_clean(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		dev->n_dirty_caches--;
+	}
+}
+
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_bucket[(obj->obj_id * 31 + chunk_id) &
+				  (YAFFS_CACHE_BUCKETS - 1)];
+}
+
+/* Point a cache chunk, possibly still holding a clean chunk, at a new one */
+static void yaffs_cache_set(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			    struct yaffs_obj *obj, int chunk_id)
+{
+	list_del_init(&cache->hash_link);
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+}
+
+static void yaffs_cache_drop(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	yaffs_cache_clean(dev, cache);
+	list_del_init(&cache->hash_link);
+	cache->object = NULL;
+}
+
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1414,47 +1590,44 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+/*
+ * Writes out the dirty cache chunks of obj in chunk id order. They are
+ * gathered and sorted once rather than searched for chunk by chunk.
+ */
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
 	int i;
+	int n = 0;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
+	int chunk_written = 1;
 	int n_caches = obj->my_dev->param.n_caches;
 
 	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+		for (i = 0; i < n_caches; i++) {
+			if (dev->cache[i].object == obj && dev->cache[i].dirty)
+				dev->cache_flush[n++] = &dev->cache[i];
+		}
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+		sort(dev->cache_flush, n, sizeof(dev->cache_flush[0]),
+		     yaffs_cache_cmp, NULL);
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+		for (i = 0; i < n; i++) {
+			cache = dev->cache_flush[i];
+			if (cache->locked)
+				break;
 
-		} while (cache && chunk_written > 0);
+			/* Write it out and free it up */
+			chunk_written = yaffs_wr_data_obj(cache->object,
+							  cache->chunk_id,
+							  cache->data,
+							  cache->n_bytes, 1);
+			yaffs_cache_drop(dev, cache);
+			if (chunk_written <= 0)
+				break;
+		}
 
-		if (cache)
+		if (chunk_written <= 0)
 			/* Hoosterman, disk full while writing cache out. */
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"yaffs tragedy: no space during cache write");
@@ -1491,6 +1664,36 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 
 }
 
+/*
+ * yaffs_flush_oldest_cache()
+ * Writes out the least recently used dirty cache chunk for background
+ * writeback. The chunk stays cached, clean. Returns the number of dirty
+ * chunks left, or -1 if nothing could be written.
+ */
+int yaffs_flush_oldest_cache(struct yaffs_dev *dev)
+{
+	struct yaffs_cache *cache = NULL;
+	int i;
+
+	for (i = 0; i < dev->param.n_caches; i++) {
+		if (dev->cache[i].object && dev->cache[i].dirty &&
+		    !dev->cache[i].locked &&
+		    (!cache || dev->cache[i].last_use < cache->last_use))
+			cache = &dev->cache[i];
+	}
+
+	if (!cache)
+		return -1;
+
+	if (yaffs_wr_data_obj(cache->object, cache->chunk_id, cache->data,
+			      cache->n_bytes, 1) <= 0)
+		return -1;
+
+	yaffs_cache_clean(dev, cache);
+
+	return dev->n_dirty_caches;
+}
+
 /* Grab us a cache chunk for use.
  * First look for an empty one.
  * Then look for the least recently used non-dirty one.
@@ -1567,14 +1770,17 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
+
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id) {
 				dev->cache_hits++;
 
-				return &dev->cache[i];
+				return cache;
 			}
 		}
 	}
@@ -1600,8 +1806,14 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 
 		cache->last_use = dev->cache_last_use;
 
-		if (is_write)
+		if (is_write && !cache->dirty) {
 			cache->dirty = 1;
+			dev->n_dirty_caches++;
+
+			if (dev->param.wb_wake_fn &&
+			    dev->n_dirty_caches >= dev->param.n_caches / 2)
+				dev->param.wb_wake_fn(dev);
+		}
 	}
 }
 
@@ -1616,7 +1828,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_drop(object->my_dev, cache);
 	}
 }
 
@@ -1632,7 +1844,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_cache_drop(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -1645,7 +1857,7 @@ static void yaffs_unhash_obj(struct yaffs_obj *obj)
 	/* If it is still linked into the bucket list, free from the list */
 	if (!list_empty(&obj->hash_link)) {
 		list_del_init(&obj->hash_link);
-		bucket = yaffs_hash_fn(obj->obj_id);
+		bucket = yaffs_hash_fn(dev, obj->obj_id);
 		dev->obj_bucket[bucket].count--;
 	}
 }
@@ -1665,6 +1877,9 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	if (!list_empty(&obj->siblings))
 		YBUG();
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_drop_name_index(obj);
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1857,6 +2072,7 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
 		INIT_LIST_HEAD(&obj->siblings);
+		INIT_LIST_HEAD(&obj->name_link);
 
 		/* Now make the directory sane */
 		if (dev->root_dir) {
@@ -1892,7 +2108,7 @@ static int yaffs_find_nice_bucket(struct yaffs_dev *dev)
 
 	for (i = 0; i < 10 && lowest > 4; i++) {
 		dev->bucket_finder++;
-		dev->bucket_finder %= YAFFS_NOBJECT_BUCKETS;
+		dev->bucket_finder %= dev->n_obj_buckets;
 		if (dev->obj_bucket[dev->bucket_finder].count < lowest) {
 			lowest = dev->obj_bucket[dev->bucket_finder].count;
 			l = dev->bucket_finder;
@@ -1903,50 +2119,102 @@ static int yaffs_find_nice_bucket(struct yaffs_dev *dev)
 	return l;
 }
 
+static int yaffs_obj_id_taken(struct yaffs_dev *dev, int bucket, u32 n)
+{
+	struct list_head *i;
+
+	list_for_each(i, &dev->obj_bucket[bucket].list) {
+		if (list_entry(i, struct yaffs_obj, hash_link)->obj_id == n)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds an unused object id, preferring a short bucket. With a large hash
+ * a bucket only holds a few ids below YAFFS_MAX_OBJECT_ID, so move on to
+ * the next bucket once one is used up. Returns -1 if all ids are taken.
+ */
 static int yaffs_new_obj_id(struct yaffs_dev *dev)
 {
 	int bucket = yaffs_find_nice_bucket(dev);
+	int tries;
+	u32 n;
+
+	for (tries = 0; tries < dev->n_obj_buckets; tries++) {
+		for (n = bucket + dev->n_obj_buckets; n <= YAFFS_MAX_OBJECT_ID;
+		     n += dev->n_obj_buckets) {
+			if (!yaffs_obj_id_taken(dev, bucket, n))
+				return n;
+		}
+		bucket = yaffs_hash_fn(dev, bucket + 1);
+	}
 
-	/* Now find an object value that has not already been taken
-	 * by scanning the list.
-	 */
+	return -1;
+}
 
-	int found = 0;
-	struct list_head *i;
+/* Double the object hash. If that fails the chains just get longer. */
+static void yaffs_grow_obj_hash(struct yaffs_dev *dev)
+{
+	int n_buckets = dev->n_obj_buckets * 2;
+	struct yaffs_obj_bucket *buckets;
+	struct yaffs_obj_bucket *b;
+	struct yaffs_obj *obj;
+	struct list_head *lh;
+	struct list_head *n;
+	int alt = 0;
+	int i;
 
-	u32 n = (u32) bucket;
+	buckets = kmalloc(n_buckets * sizeof(struct yaffs_obj_bucket),
+			  GFP_NOFS);
+	if (!buckets) {
+		buckets = vmalloc(n_buckets * sizeof(struct yaffs_obj_bucket));
+		alt = 1;
+	}
+	if (!buckets)
+		return;
 
-	/* yaffs_check_obj_hash_sane();  */
+	for (i = 0; i < n_buckets; i++) {
+		INIT_LIST_HEAD(&buckets[i].list);
+		buckets[i].count = 0;
+	}
 
-	while (!found) {
-		found = 1;
-		n += YAFFS_NOBJECT_BUCKETS;
-		if (1 || dev->obj_bucket[bucket].count > 0) {
-			list_for_each(i, &dev->obj_bucket[bucket].list) {
-				/* If there is already one in the list */
-				if (i && list_entry(i, struct yaffs_obj,
-						    hash_link)->obj_id == n) {
-					found = 0;
-				}
-			}
+	for (i = 0; i < dev->n_obj_buckets; i++) {
+		list_for_each_safe(lh, n, &dev->obj_bucket[i].list) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			b = &buckets[obj->obj_id & (n_buckets - 1)];
+			list_move(lh, &b->list);
+			b->count++;
 		}
 	}
 
-	return n;
+	yaffs_free_obj_hash(dev);
+	dev->obj_bucket = buckets;
+	dev->obj_bucket_alt = alt;
+	dev->n_obj_buckets = n_buckets;
+
+	yaffs_trace(YAFFS_TRACE_ALLOCATE,
+		"object hash grown to %d buckets for %d objects",
+		n_buckets, dev->n_obj);
 }
 
 static void yaffs_hash_obj(struct yaffs_obj *in)
 {
-	int bucket = yaffs_hash_fn(in->obj_id);
 	struct yaffs_dev *dev = in->my_dev;
+	int bucket = yaffs_hash_fn(dev, in->obj_id);
 
 	list_add(&in->hash_link, &dev->obj_bucket[bucket].list);
 	dev->obj_bucket[bucket].count++;
+
+	if (dev->n_obj > dev->n_obj_buckets * YAFFS_NOBJECT_BUCKET_LOAD &&
+	    dev->n_obj_buckets < YAFFS_MAX_NOBJECT_BUCKETS)
+		yaffs_grow_obj_hash(dev);
 }
 
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number)
 {
-	int bucket = yaffs_hash_fn(number);
+	int bucket = yaffs_hash_fn(dev, number);
 	struct list_head *i;
 	struct yaffs_obj *in;
 
@@ -1974,8 +2242,11 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	struct yaffs_obj *the_obj = NULL;
 	struct yaffs_tnode *tn = NULL;
 
-	if (number < 0)
+	if (number < 0) {
 		number = yaffs_new_obj_id(dev);
+		if (number < 0)
+			return NULL;
+	}
 
 	if (type == YAFFS_OBJECT_TYPE_FILE) {
 		tn = yaffs_get_tnode(dev);
@@ -2049,17 +2320,12 @@ static struct yaffs_obj *yaffs_create_fake_dir(struct yaffs_dev *dev,
 
 static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 {
-	int i;
-
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
 
 	yaffs_init_raw_tnodes_and_objs(dev);
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
-		dev->obj_bucket[i].count = 0;
-	}
+	yaffs_init_obj_hash(dev);
 }
 
 struct yaffs_obj *yaffs_find_or_create_by_number(struct yaffs_dev *dev,
@@ -2336,7 +2602,7 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 		memset(dev->block_info, 0,
 		       n_blocks * sizeof(struct yaffs_block_info));
 		memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
-		return YAFFS_OK;
+		return yaffs_gc_index_init(dev);
 	}
 
 	return YAFFS_FAIL;
@@ -2358,6 +2624,8 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 	else if (dev->chunk_bits)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
+
+	yaffs_gc_index_deinit(dev);
 	dev->chunk_bits = NULL;
 }
 
@@ -2379,6 +2647,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_index_update(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if (block_no == dev->gc_block)
@@ -2468,8 +2737,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_index_update(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2679,6 +2950,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_index_update(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2716,38 +2988,27 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 }
 
 /*
- * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * FindBlockForgarbageCollection is used to select the dirtiest block
+ * for garbage collection. The gc index keeps full blocks sorted by pages
+ * in use, so this does not scan the block array.
  */
 
 static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				    int aggressive, int background)
 {
-	int i;
-	int iterations;
+	struct yaffs_block_info *bi;
 	unsigned selected = 0;
 	int prioritised = 0;
 	int prioritised_exist = 0;
-	struct yaffs_block_info *bi;
 	int threshold;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->has_pending_prioritised_gc && !aggressive) {
 		dev->gc_dirtiest = 0;
-		bi = dev->block_info;
-		for (i = dev->internal_start_block;
-		     i <= dev->internal_end_block && !selected; i++) {
-
-			if (bi->gc_prioritise) {
-				prioritised_exist = 1;
-				if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-				    yaffs_block_ok_for_gc(dev, bi)) {
-					selected = i;
-					prioritised = 1;
-				}
-			}
-			bi++;
-		}
+		selected = yaffs_gc_index_find_prioritised(dev,
+							   &prioritised_exist);
+		if (selected)
+			prioritised = 1;
 
 		/*
 		 * If there is a prioritised block and none was selected then
@@ -2761,21 +3022,22 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 		if (!prioritised_exist)	/* None found, so we can clear this */
 			dev->has_pending_prioritised_gc = 0;
+
+		if (selected) {
+			bi = yaffs_get_block_info(dev, selected);
+			dev->gc_pages_in_use =
+			    bi->pages_in_use - bi->soft_del_pages;
+		}
 	}
 
-	/* If we're doing aggressive GC then we are happy to take a less-dirty block, and
-	 * search harder.
+	/* If we're doing aggressive GC then we are happy to take a less-dirty block.
 	 * else (we're doing a leasurely gc), then we only bother to do this if the
 	 * block has only a few pages in use.
 	 */
 
 	if (!selected) {
-		int pages_used;
-		int n_blocks =
-		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
-			threshold = dev->param.chunks_per_block;
-			iterations = n_blocks;
+			threshold = dev->param.chunks_per_block - 1;
 		} else {
 			int max_threshold;
 
@@ -2792,38 +3054,15 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 			if (threshold > max_threshold)
 				threshold = max_threshold;
-
-			iterations = n_blocks / 16 + 1;
-			if (iterations > 100)
-				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH); i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
-			}
+		selected = yaffs_gc_index_find(dev, threshold);
+		if (selected) {
+			bi = yaffs_get_block_info(dev, selected);
+			dev->gc_dirtiest = selected;
+			dev->gc_pages_in_use =
+			    bi->pages_in_use - bi->soft_del_pages;
 		}
-
-		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
-			selected = dev->gc_dirtiest;
 	}
 
 	/*
@@ -2865,8 +3104,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	} else {
 		dev->gc_not_done++;
 		yaffs_trace(YAFFS_TRACE_GC,
-			"GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s",
-			dev->gc_block_finder, dev->gc_not_done, threshold,
+			"GC none: skip %d dirtiest %d using %d oldest %d%s",
+			dev->gc_not_done,
 			dev->gc_dirtiest, dev->gc_pages_in_use,
 			dev->oldest_dirty_block, background ? " bg" : "");
 	}
@@ -3061,6 +3300,7 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		yaffs_clear_chunk_bit(dev, block, page);
 
 		bi->pages_in_use--;
+		yaffs_gc_index_update(dev, block);
 
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
@@ -3581,9 +3821,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
+					yaffs_cache_set(dev, cache, in, chunk);
+					yaffs_cache_clean(dev, cache);
 					cache->locked = 0;
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
@@ -3707,9 +3946,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
+					yaffs_cache_set(dev, cache, in, chunk);
+					yaffs_cache_clean(dev, cache);
 					cache->locked = 0;
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
@@ -3740,7 +3978,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_clean(dev, cache);
 					}
 
 				} else {
@@ -4383,7 +4621,7 @@ static void yaffs_fix_hanging_objs(struct yaffs_dev *dev)
 	 * Make sure it is rooted.
 	 */
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; i < dev->n_obj_buckets; i++) {
 		list_for_each_safe(lh, n, &dev->obj_bucket[i].list) {
 			if (lh) {
 				obj =
@@ -4466,15 +4704,38 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+static int yaffs_is_named(struct yaffs_obj *l, const YCHAR * name, u16 sum,
+			  YCHAR * buffer)
+{
+	yaffs_check_obj_details_loaded(l);
+
+	/* Special case for lost-n-found */
+	if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return !strcmp(name, YAFFS_LOSTNFOUND_NAME);
+
+	if (l->sum != sum && l->hdr_chunk > 0)
+		return 0;
+
+	/* LostnFound chunk called Objxxx
+	 * Do a real check
+	 */
+	yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+	return strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR * name)
 {
-	int sum;
+	u16 sum;
+	int n_children = 0;
 
 	struct list_head *i;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 
 	struct yaffs_obj *l;
+	struct yaffs_obj *found = NULL;
+	struct yaffs_obj *lnf;
+	struct yaffs_name_index *ni;
 
 	if (!name)
 		return NULL;
@@ -4494,35 +4755,43 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 	}
 
 	sum = yaffs_calc_name_sum(name);
+	lnf = directory->my_dev->lost_n_found;
+	ni = directory->variant.dir_variant.name_index;
+
+	if (ni) {
+		/* lost+found is not in the index */
+		if (lnf && lnf->parent == directory &&
+		    !strcmp(name, YAFFS_LOSTNFOUND_NAME))
+			return lnf;
+
+		list_for_each(i, &ni->bucket[sum & (ni->n_buckets - 1)]) {
+			l = list_entry(i, struct yaffs_obj, name_link);
+			if (yaffs_is_named(l, name, sum, buffer))
+				return l;
+		}
+		return NULL;
+	}
 
 	list_for_each(i, &directory->variant.dir_variant.children) {
-		if (i) {
-			l = list_entry(i, struct yaffs_obj, siblings);
-
-			if (l->parent != directory)
-				YBUG();
+		l = list_entry(i, struct yaffs_obj, siblings);
 
-			yaffs_check_obj_details_loaded(l);
+		if (l->parent != directory)
+			YBUG();
 
-			/* Special case for lost-n-found */
-			if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-					return l;
-			} else if (l->sum == sum
-				   || l->hdr_chunk <= 0) {
-				/* LostnFound chunk called Objxxx
-				 * Do a real check
-				 */
-				yaffs_get_obj_name(l, buffer,
-						   YAFFS_MAX_NAME_LENGTH + 1);
-				if (strncmp
-				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
-			}
+		n_children++;
+		if (yaffs_is_named(l, name, sum, buffer)) {
+			found = l;
+			break;
 		}
 	}
 
-	return NULL;
+	/* Orphans in lost+found are named from their ids, not their sums,
+	 * so it is always walked.
+	 */
+	if (n_children >= YAFFS_NAME_INDEX_MIN && directory != lnf)
+		yaffs_build_name_index(directory, n_children);
+
+	return found;
 }
 
 /* GetEquivalentObject dereferences any hard links to get to the
@@ -4916,7 +5185,6 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
-	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
@@ -4939,6 +5207,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_flush = NULL;
+	dev->n_dirty_caches = 0;
 	dev->gc_cleanup_list = NULL;
 
 	if (!init_failed && dev->param.n_caches > 0) {
@@ -4951,13 +5221,21 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_flush = kmalloc(dev->param.n_caches *
+					   sizeof(*dev->cache_flush), GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_flush)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		for (i = 0; i < YAFFS_CACHE_BUCKETS; i++)
+			INIT_LIST_HEAD(&dev->cache_bucket[i]);
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
 			dev->cache[i].object = NULL;
 			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
@@ -4995,6 +5273,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		/* Now scan the flash. */
 		if (dev->param.is_yaffs2) {
 			if (yaffs2_checkpt_restore(dev)) {
+				dev->mount_from_checkpt = 1;
 				yaffs_check_obj_details_loaded(dev->root_dir);
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
 					"yaffs: restored from checkpoint"
@@ -5032,6 +5311,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
                 }
 
+		yaffs_gc_index_rebuild(dev);
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
@@ -5048,6 +5328,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	}
 
 	/* Zero out stats */
+	dev->mount_page_reads = dev->n_page_reads;
 	dev->n_page_reads = 0;
 	dev->n_page_writes = 0;
 	dev->n_erasures = 0;
@@ -5087,6 +5368,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_flush);
+		dev->cache_flush = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
@@ -5132,21 +5415,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Subtract the dirty chunks in the cache */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -55,7 +55,14 @@
 #define YAFFS_ALLOCATION_NTNODES	100
 #define YAFFS_ALLOCATION_NLINKS		100
 
-#define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_NOBJECT_BUCKETS		256	/* initial object hash size */
+#define YAFFS_MAX_NOBJECT_BUCKETS	16384
+#define YAFFS_NOBJECT_BUCKET_LOAD	4	/* mean chain length to grow at */
+
+/* Directories with at least this many children get a name index */
+#define YAFFS_NAME_INDEX_MIN		32
+#define YAFFS_NAME_INDEX_MAX_BUCKETS	2048
+#define YAFFS_NAME_INDEX_LOAD		4
 
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
@@ -83,7 +90,8 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
+#define YAFFS_CACHE_BUCKETS		64	/* power of 2 */
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -108,6 +116,7 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* in dev->cache_bucket when used */
 	struct yaffs_obj *object;
 	int chunk_id;
 	int last_use;
@@ -286,6 +295,12 @@ struct yaffs_block_info {
 
 };
 
+/* Link of a block in the gc victim index, see yaffs_gcindex.c */
+struct yaffs_gc_link {
+	struct list_head list;
+	int bucket;		/* list it is on, -1 if none */
+};
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -354,9 +369,17 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+/* Children of a large directory hashed by name sum, built on lookup */
+struct yaffs_name_index {
+	int n_buckets;		/* power of 2 */
+	int n_named;		/* children linked into the buckets */
+	struct list_head bucket[];
+};
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_name_index *name_index;	/* NULL until needed */
 };
 
 struct yaffs_symlink_var {
@@ -400,7 +423,7 @@ struct yaffs_obj {
 	u8 has_xattr:1;		/* This object has xattribs. Valid if xattr_known. */
 
 	u8 serial;		/* serial number of chunk in NAND. Cached here */
-	u16 sum;		/* sum of the name to speed searching */
+	u16 sum;		/* hash of the name to speed searching */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
 
@@ -412,6 +435,7 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct list_head name_link;	/* entry in the parent's name index */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -506,8 +530,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -562,6 +586,11 @@ struct yaffs_param {
 	/*  Callback to control garbage collection. */
 	unsigned (*gc_control) (struct yaffs_dev * dev);
 
+	/* Callback to start writing back dirty cache chunks in the background,
+	 * called when half the caches are dirty.
+	 */
+	void (*wb_wake_fn) (struct yaffs_dev * dev);
+
 	/* Debug control flags. Don't use unless you know what you're doing */
 	int use_header_file_size;	/* Flag to determine if we should use file sizes from the header */
 	int disable_lazy_load;	/* Disable lazy loading on this device */
@@ -637,10 +666,15 @@ struct yaffs_dev {
 	u8 *chunk_bits;		/* bitmap of chunks in use */
 	unsigned block_info_alt:1;	/* was allocated using alternative strategy */
 	unsigned chunk_bits_alt:1;	/* was allocated using alternative strategy */
+	unsigned gc_links_alt:1;	/* was allocated using alternative strategy */
 	int chunk_bit_stride;	/* Number of bytes of chunk_bits per block.
 				 * Must be consistent with chunks_per_block.
 				 */
 
+	/* GC victim index: full blocks listed by pages in use */
+	struct yaffs_gc_link *gc_links;
+	struct list_head *gc_buckets;
+
 	int n_erased_blocks;
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
@@ -653,7 +687,10 @@ struct yaffs_dev {
 
 	int n_hardlinks;
 
-	struct yaffs_obj_bucket obj_bucket[YAFFS_NOBJECT_BUCKETS];
+	struct yaffs_obj_bucket *obj_bucket;	/* n_obj_buckets entries */
+	struct yaffs_obj_bucket obj_bucket_base[YAFFS_NOBJECT_BUCKETS];
+	int n_obj_buckets;	/* power of 2, grows with n_obj */
+	int obj_bucket_alt;	/* obj_bucket was vmalloced */
 	u32 bucket_finder;
 
 	int n_free_chunks;
@@ -664,7 +701,6 @@ struct yaffs_dev {
 
 	unsigned has_pending_prioritised_gc;	/* We think this device might have pending prioritised gcs */
 	unsigned gc_disable;
-	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
 	unsigned gc_not_done;
@@ -685,7 +721,10 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
+	struct list_head cache_bucket[YAFFS_CACHE_BUCKETS]; /* by obj, chunk */
+	struct yaffs_cache **cache_flush;	/* yaffs_flush_file_cache() */
 	int cache_last_use;
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -734,6 +773,12 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 n_checkpt_saves;
+
+	/* Mount statistics */
+	u32 mount_ms;		/* Time yaffs_guts_initialise() took, set by the OS glue */
+	u32 mount_page_reads;	/* Chunks read while mounting */
+	int mount_from_checkpt;	/* Mounted from a checkpoint rather than a scan */
 
 };
 
@@ -813,6 +858,7 @@ int yaffs_flush_file(struct yaffs_obj *obj, int update_time, int data_sync);
 
 /* Flushing and checkpointing */
 void yaffs_flush_whole_cache(struct yaffs_dev *dev);
+int yaffs_flush_oldest_cache(struct yaffs_dev *dev);
 
 int yaffs_checkpoint_save(struct yaffs_dev *dev);
 int yaffs_checkpoint_restore(struct yaffs_dev *dev);
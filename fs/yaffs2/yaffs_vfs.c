@@ -97,6 +97,7 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_idle_checkpoint = 60;
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -104,6 +105,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_idle_checkpoint, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -1623,7 +1625,10 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
 	unsigned long expires;
-	unsigned int urgency;
+	unsigned int urgency = 0;
+	int batches;
+	u32 last_writes = 0;
+	unsigned long last_write_time = now;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1654,6 +1659,21 @@ static int yaffs_bg_thread_fn(void *data)
 			if (!dev->is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
 				gc_result = yaffs_bg_gc(dev, urgency);
+
+				/*
+				 * Finish the block in hand a batch of copies
+				 * at a time, letting others in between.
+				 */
+				for (batches = 0; dev->gc_block > 0 &&
+				     batches < dev->param.chunks_per_block &&
+				     !kthread_should_stop(); batches++) {
+					yaffs_gross_unlock(dev);
+					cond_resched();
+					yaffs_gross_lock(dev);
+					if (dev->is_checkpointed)
+						break;
+					gc_result = yaffs_bg_gc(dev, urgency);
+				}
 				if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
@@ -1668,6 +1688,29 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
+
+		/*
+		 * Write a checkpoint once the device has been idle for
+		 * yaffs_idle_checkpoint seconds, so that a mount after an
+		 * unclean shutdown rarely has to scan.
+		 */
+		if (dev->n_page_writes != last_writes) {
+			last_writes = dev->n_page_writes;
+			last_write_time = now;
+		} else if (yaffs_idle_checkpoint && yaffs_bg_enable &&
+			   dev->param.is_yaffs2 && !dev->param.skip_checkpt_wr &&
+			   !dev->is_checkpointed && !urgency &&
+			   time_after(now, last_write_time +
+				      yaffs_idle_checkpoint * HZ)) {
+			yaffs_trace(YAFFS_TRACE_BACKGROUND |
+				    YAFFS_TRACE_CHECKPOINT,
+				"yaffs_background: idle checkpoint");
+			yaffs_flush_super(context->super, 1);
+			context->super->s_dirt = 0;
+			/* If it failed, retry after another idle period */
+			last_write_time = now;
+		}
+
 		yaffs_gross_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
@@ -1689,6 +1732,97 @@ static int yaffs_bg_thread_fn(void *data)
 	return 0;
 }
 
+/*
+ * yaffs writeback thread functions.
+ * yaffs_wb_thread_fn() writes dirty cache chunks out, oldest first, until
+ * a quarter of the caches are dirty. It is woken by yaffs_wb_wake() once
+ * half of them are, so writers rarely have to flush the cache themselves.
+ * The lock is dropped between chunks to let readers in.
+ */
+
+static void yaffs_wb_wake(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
+	if (context->wb_thread)
+		wake_up_process(context->wb_thread);
+}
+
+static int yaffs_wb_thread_fn(void *data)
+{
+	struct yaffs_dev *dev = (struct yaffs_dev *)data;
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+	int low = dev->param.n_caches / 4;
+	int n_dirty;
+
+	yaffs_trace(YAFFS_TRACE_BACKGROUND,
+		"yaffs_writeback starting for dev %p", (void *)dev);
+
+	set_freezable();
+	while (context->wb_running) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (dev->n_dirty_caches <= low && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		if (kthread_should_stop())
+			break;
+
+		if (try_to_freeze())
+			continue;
+
+		do {
+			yaffs_gross_lock(dev);
+			if (dev->read_only || dev->n_dirty_caches <= low)
+				n_dirty = 0;
+			else
+				n_dirty = yaffs_flush_oldest_cache(dev);
+			yaffs_gross_unlock(dev);
+			cond_resched();
+		} while (n_dirty > low && !kthread_should_stop());
+
+		/* Nothing could be written, e.g. no space: back off */
+		if (n_dirty < 0)
+			schedule_timeout_interruptible(HZ);
+	}
+
+	return 0;
+}
+
+static int yaffs_wb_start(struct yaffs_dev *dev)
+{
+	int retval = 0;
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
+	if (dev->read_only || dev->param.n_caches < 4)
+		return -1;
+
+	context->wb_running = 1;
+
+	context->wb_thread = kthread_run(yaffs_wb_thread_fn,
+					 (void *)dev, "yaffs-wb-%d",
+					 context->mount_id);
+
+	if (IS_ERR(context->wb_thread)) {
+		retval = PTR_ERR(context->wb_thread);
+		context->wb_thread = NULL;
+		context->wb_running = 0;
+	}
+	return retval;
+}
+
+static void yaffs_wb_stop(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *ctxt = yaffs_dev_to_lc(dev);
+
+	ctxt->wb_running = 0;
+
+	if (ctxt->wb_thread) {
+		kthread_stop(ctxt->wb_thread);
+		ctxt->wb_thread = NULL;
+	}
+}
+
 static int yaffs_bg_start(struct yaffs_dev *dev)
 {
 	int retval = 0;
@@ -1758,6 +1892,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;		/* -1 to size the cache to the device */
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -1813,6 +1948,11 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache=", 6)) {
+			options->n_caches =
+				simple_strtoul(cur_opt + 6, NULL, 0);
+			if (options->n_caches > YAFFS_MAX_SHORT_OP_CACHES)
+				options->n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -1963,6 +2103,7 @@ static void yaffs_put_super(struct super_block *sb)
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"Shutting down yaffs background thread");
 	yaffs_bg_stop(dev);
+	yaffs_wb_stop(dev);
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"yaffs background thread shut down");
 
@@ -2026,6 +2167,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	struct yaffs_options options;
 
 	unsigned mount_id;
+	unsigned long mount_start;
 	int found;
 	struct yaffs_linux_context *context_iterator;
 	struct list_head *l;
@@ -2055,6 +2197,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	printk(KERN_INFO "yaffs: passed flags \"%s\"\n", data_str);
 
 	memset(&options, 0, sizeof(options));
+	options.n_caches = -1;
 
 	if (yaffs_parse_options(&options, data_str)) {
 		/* Option parsing failed */
@@ -2215,7 +2358,6 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2279,6 +2421,22 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->query_block_fn = nandmtd1_query_block;
 		param->is_yaffs2 = 0;
 	}
+	/*
+	 * Short op cache: one chunk per 64 blocks, so larger devices that
+	 * take more writes get more write buffering.
+	 */
+	if (options.no_cache) {
+		param->n_caches = 0;
+	} else if (options.n_caches >= 0) {
+		param->n_caches = options.n_caches;
+	} else {
+		param->n_caches = n_blocks / 64;
+		if (param->n_caches < 10)
+			param->n_caches = 10;
+		if (param->n_caches > YAFFS_MAX_SHORT_OP_CACHES)
+			param->n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+	}
+
 	/* ... and common functions */
 	param->erase_fn = nandmtd_erase_block;
 	param->initialise_flash_fn = nandmtd_initialise;
@@ -2287,6 +2445,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->sb_dirty_fn = yaffs_touch_super;
 	param->gc_control = yaffs_gc_control_callback;
+	param->wb_wake_fn = yaffs_wb_wake;
 
 	yaffs_dev_to_lc(dev)->super = sb;
 
@@ -2324,14 +2483,18 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	yaffs_gross_lock(dev);
 
+	mount_start = jiffies;
 	err = yaffs_guts_initialise(dev);
+	dev->mount_ms = jiffies_to_msecs(jiffies - mount_start);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_super: guts initialised %s",
 		(err == YAFFS_OK) ? "OK" : "FAILED");
 
-	if (err == YAFFS_OK)
+	if (err == YAFFS_OK) {
 		yaffs_bg_start(dev);
+		yaffs_wb_start(dev);
+	}
 
 	if (!context->bg_thread)
 		param->defered_dir_update = 0;
@@ -2460,7 +2623,9 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_tnodes.............. %d\n", dev->n_tnodes);
 	buf += sprintf(buf, "n_obj................. %d\n", dev->n_obj);
+	buf += sprintf(buf, "n_obj_buckets......... %d\n", dev->n_obj_buckets);
 	buf += sprintf(buf, "n_free_chunks......... %d\n", dev->n_free_chunks);
+	buf += sprintf(buf, "n_dirty_caches........ %d\n", dev->n_dirty_caches);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_page_writes......... %u\n", dev->n_page_writes);
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
@@ -2486,6 +2651,14 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf +=
+	    sprintf(buf, "n_checkpt_saves....... %u\n", dev->n_checkpt_saves);
+	buf += sprintf(buf, "mount_ms.............. %u\n", dev->mount_ms);
+	buf +=
+	    sprintf(buf, "mount_page_reads...... %u\n", dev->mount_page_reads);
+	buf +=
+	    sprintf(buf, "mount_from_checkpt.... %d\n",
+		    dev->mount_from_checkpt);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
@@ -566,7 +566,7 @@ static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev)
 	 * dumping them to the checkpointing stream.
 	 */
 
-	for (i = 0; ok && i < YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; ok && i < dev->n_obj_buckets; i++) {
 		list_for_each(lh, &dev->obj_bucket[i].list) {
 			if (lh) {
 				obj =
@@ -819,6 +819,8 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 	if (!dev->is_checkpointed) {
 		yaffs2_checkpt_invalidate(dev);
 		yaffs2_wr_checkpt_data(dev);
+		if (dev->is_checkpointed)
+			dev->n_checkpt_saves++;
 	}
 
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
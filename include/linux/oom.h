@@ -50,6 +50,20 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events passed to oom_adj notifiers along with the task concerned. They
+ * are called from process context without locks held, but must not sleep.
+ */
+#define OOM_ADJ_FORK	0	/* a new thread group leader was created */
+#define OOM_ADJ_CHANGE	1	/* oom_adj of the task was written */
+#define OOM_ADJ_EXIT	2	/* the last thread of the group dropped its mm,
+				 * others may still hold it */
+#define OOM_ADJ_EXEC	3	/* the task stopped leading its group in exec() */
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(struct task_struct *p, unsigned long event);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
@@ -985,8 +985,15 @@ NORET_TYPE void do_exit(long code)
 
 	exit_mm(tsk);
 
-	if (group_dead)
+	if (group_dead) {
+		/*
+		 * After exit_mm(), the group no longer uses its mm. The memory
+		 * is only freed once other users such as /proc readers or a
+		 * ptracer drop theirs, which is usually right away.
+		 */
+		oom_adj_notify(tsk, OOM_ADJ_EXIT);
 		acct_process();
+	}
 	trace_sched_process_exit(tsk);
 
 	exit_sem(tsk);
@@ -38,12 +38,25 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_INITIALIZED            (1U << 8)
 #define WAKE_LOCK_ACTIVE                 (1U << 9)
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
-#define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
+/*
+ * Locking: list_lock protects the list of all wake locks and is only taken
+ * on init, destroy and to report stats. timeout_lock protects the trees of
+ * active wake locks with a timeout and expire_timer. Each wake lock's own
+ * spinlock protects its flags, expiry and stats.
+ *
+ * Lock Ordering: list_lock -> timeout_lock -> lock->lock
+ *
+ * Wake locks without a timeout are only counted in active_count, so taking
+ * and releasing them only touches the lock itself and one atomic counter.
+ * Wake locks with a timeout are kept in a tree ordered by expiry.
+ */
 static DEFINE_SPINLOCK(list_lock);
-static LIST_HEAD(inactive_locks);
-static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
-static int current_event_num;
+static LIST_HEAD(wake_locks);
+static DEFINE_SPINLOCK(timeout_lock);
+static struct rb_root timeout_locks[WAKE_LOCK_TYPE_COUNT];
+static atomic_t active_count[WAKE_LOCK_TYPE_COUNT];
+static atomic_t current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
@@ -51,9 +64,15 @@ static struct wake_lock unknown_wakeup;
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * When main_wake_lock was last released, or zero while it is held. Any
+ * other active suspend wake lock prevents suspend from then on.
+ */
+static ktime_t suspend_blocked_since;
+static DEFINE_SEQLOCK(suspend_blocked_lock);
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -80,6 +99,34 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 	return 1;
 }
 
+/*
+ * prevent_suspend_time - how long the active wake lock 'lock' has
+ * prevented suspend, up to 'now', since it was last accounted for.
+ *
+ * Caller must hold lock->lock.
+ */
+static ktime_t prevent_suspend_time(struct wake_lock *lock, ktime_t now)
+{
+	ktime_t since;
+	unsigned long seq;
+
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) != WAKE_LOCK_SUSPEND ||
+	    lock == &main_wake_lock)
+		return ktime_set(0, 0);
+
+	do {
+		seq = read_seqbegin(&suspend_blocked_lock);
+		since = suspend_blocked_since;
+	} while (read_seqretry(&suspend_blocked_lock, seq));
+
+	if (!since.tv64)
+		return ktime_set(0, 0);
+	if (lock->stat.last_time.tv64 > since.tv64)
+		since = lock->stat.last_time;
+	if (now.tv64 <= since.tv64)
+		return ktime_set(0, 0);
+	return ktime_sub(now, since);
+}
 
 static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 {
@@ -89,7 +136,7 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 	ktime_t total_time = lock->stat.total_time;
 	ktime_t max_time = lock->stat.max_time;
 
-	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
+	ktime_t prevent_time = lock->stat.prevent_suspend_time;
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
 		ktime_t now, add_time;
 		int expired = get_expired_time(lock, &now);
@@ -102,9 +149,8 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		else
 			expire_count++;
 		total_time = ktime_add(total_time, add_time);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
-			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+		prevent_time = ktime_add(prevent_time,
+					 prevent_suspend_time(lock, now));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -114,7 +160,7 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		     lock->name, lock_count, expire_count,
 		     lock->stat.wakeup_count, ktime_to_ns(active_time),
 		     ktime_to_ns(total_time),
-		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
+		     ktime_to_ns(prevent_time), ktime_to_ns(max_time),
 		     ktime_to_ns(lock->stat.last_time));
 }
 
@@ -123,22 +169,21 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	unsigned long irqflags;
 	struct wake_lock *lock;
 	int ret;
-	int type;
 
 	spin_lock_irqsave(&list_lock, irqflags);
 
 	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
 			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link)
+	list_for_each_entry(lock, &wake_locks, link) {
+		spin_lock(&lock->lock);
 		ret = print_lock_stat(m, lock);
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
-			ret = print_lock_stat(m, lock);
+		spin_unlock(&lock->lock);
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
 }
 
+/* Caller must hold lock->lock. */
 static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 {
 	ktime_t duration;
@@ -156,63 +201,102 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
+	lock->stat.prevent_suspend_time = ktime_add(
+		lock->stat.prevent_suspend_time,
+		prevent_suspend_time(lock, now));
 	lock->stat.last_time = ktime_get();
-	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
-		lock->stat.prevent_suspend_time = ktime_add(
-			lock->stat.prevent_suspend_time, duration);
-		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+/*
+ * update_sleep_wait_stats - called when main_wake_lock changes state. Only
+ * taking main_wake_lock needs to walk the active wake locks, to account for
+ * the time they prevented suspend until now; each lock does that itself on
+ * release otherwise.
+ */
+static void update_sleep_wait_stats(int done)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
+	unsigned long irqflags;
+	ktime_t since, start, now, etime;
 
 	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+	write_seqlock_irqsave(&suspend_blocked_lock, irqflags);
+	since = suspend_blocked_since;
+	suspend_blocked_since = done ? ktime_set(0, 0) : now;
+	write_sequnlock_irqrestore(&suspend_blocked_lock, irqflags);
+
+	if (!done || !since.tv64)
+		return;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_for_each_entry(lock, &wake_locks, link) {
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) != WAKE_LOCK_SUSPEND ||
+		    lock == &main_wake_lock)
+			continue;
+		spin_lock(&lock->lock);
+		if (lock->flags & WAKE_LOCK_ACTIVE) {
+			etime = now;
+			get_expired_time(lock, &etime);
+			start = since;
+			if (lock->stat.last_time.tv64 > start.tv64)
+				start = lock->stat.last_time;
+			if (etime.tv64 > start.tv64)
+				lock->stat.prevent_suspend_time = ktime_add(
+					lock->stat.prevent_suspend_time,
+					ktime_sub(etime, start));
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+		spin_unlock(&lock->lock);
 	}
-	last_sleep_time_update = now;
+	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 #endif
 
+/* Caller must hold timeout_lock. */
+static void timeout_insert_locked(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &timeout_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, node);
+		if (time_before(lock->expires, entry->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->node, parent, p);
+	rb_insert_color(&lock->node, &timeout_locks[type]);
+}
 
+/* Caller must hold timeout_lock and lock->lock. */
 static void expire_wake_lock(struct wake_lock *lock)
 {
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+	rb_erase(&lock->node, &timeout_locks[type]);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
 }
 
-/* Caller must acquire the list_lock spinlock */
+/* Takes list_lock, so the caller must not hold timeout_lock. */
 static void print_active_locks(int type)
 {
 	struct wake_lock *lock;
+	unsigned long irqflags;
 	bool print_expired = true;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry(lock, &active_wake_locks[type], link) {
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_for_each_entry(lock, &wake_locks, link) {
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) != type ||
+		    !(lock->flags & WAKE_LOCK_ACTIVE))
+			continue;
 		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
 			long timeout = lock->expires - jiffies;
 			if (timeout > 0)
@@ -226,36 +310,49 @@ static void print_active_locks(int type)
 				print_expired = false;
 		}
 	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
+/*
+ * has_wake_lock_locked - expires the timed out wake locks of 'type' and
+ * returns -1 if any wake lock without a timeout is active, otherwise the
+ * number of jiffies until the last active one times out.
+ *
+ * Caller must hold timeout_lock.
+ */
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	struct rb_node *n;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	while ((n = rb_first(&timeout_locks[type]))) {
+		lock = rb_entry(n, struct wake_lock, node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		spin_lock(&lock->lock);
+		expire_wake_lock(lock);
+		spin_unlock(&lock->lock);
 	}
-	return max_timeout;
+	if (atomic_read(&active_count[type]))
+		return -1;
+
+	n = rb_last(&timeout_locks[type]);
+	if (!n)
+		return 0;
+	lock = rb_entry(n, struct wake_lock, node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
 {
 	long ret;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock_irqsave(&timeout_lock, irqflags);
 	ret = has_wake_lock_locked(type);
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
 	if (ret && (debug_mask & DEBUG_SUSPEND) && type == WAKE_LOCK_SUSPEND)
 		print_active_locks(type);
-	spin_unlock_irqrestore(&list_lock, irqflags);
 	return ret;
 }
 
@@ -270,7 +367,7 @@ static void suspend(struct work_struct *work)
 		return;
 	}
 
-	entry_event_num = current_event_num;
+	entry_event_num = atomic_read(&current_event_num);
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
@@ -285,7 +382,7 @@ static void suspend(struct work_struct *work)
 			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
 			tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec);
 	}
-	if (current_event_num == entry_event_num) {
+	if (atomic_read(&current_event_num) == entry_event_num) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
@@ -299,18 +396,43 @@ static void expire_wake_locks(unsigned long data)
 	unsigned long irqflags;
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: start\n");
-	spin_lock_irqsave(&list_lock, irqflags);
 	if (debug_mask & DEBUG_SUSPEND)
 		print_active_locks(WAKE_LOCK_SUSPEND);
+	spin_lock_irqsave(&timeout_lock, irqflags);
 	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
 	if (has_lock == 0)
 		queue_work(suspend_work_queue, &suspend_work);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
 }
 static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
+/*
+ * update_expire_timer - arms expire_timer for when the last suspend wake
+ * lock times out, or starts suspend if there is none left.
+ *
+ * Caller must hold timeout_lock.
+ */
+static void update_expire_timer(struct wake_lock *lock, const char *caller)
+{
+	long has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
+
+	if (has_lock > 0) {
+		if (debug_mask & DEBUG_EXPIRE)
+			pr_info("%s: %s, start expire timer, %ld\n",
+				caller, lock->name, has_lock);
+		mod_timer(&expire_timer, jiffies + has_lock);
+	} else {
+		if (del_timer(&expire_timer))
+			if (debug_mask & DEBUG_EXPIRE)
+				pr_info("%s: %s, stop expire timer\n",
+					caller, lock->name);
+		if (has_lock == 0)
+			queue_work(suspend_work_queue, &suspend_work);
+	}
+}
+
 static int power_suspend_late(struct device *dev)
 {
 	int ret = has_wake_lock(WAKE_LOCK_SUSPEND) ? -EAGAIN : 0;
@@ -354,10 +476,12 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.last_time = ktime_set(0, 0);
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
+	spin_lock_init(&lock->lock);
+	RB_CLEAR_NODE(&lock->node);
 
 	INIT_LIST_HEAD(&lock->link);
 	spin_lock_irqsave(&list_lock, irqflags);
-	list_add(&lock->link, &inactive_locks);
+	list_add(&lock->link, &wake_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
@@ -365,12 +489,24 @@ EXPORT_SYMBOL(wake_lock_init);
 void wake_lock_destroy(struct wake_lock *lock)
 {
 	unsigned long irqflags;
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	spin_lock(&timeout_lock);
+	spin_lock(&lock->lock);
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->node, &timeout_locks[type]);
+	else if (lock->flags & WAKE_LOCK_ACTIVE)
+		atomic_dec(&active_count[type]);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
+	spin_unlock(&lock->lock);
+	spin_unlock(&timeout_lock);
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
+		spin_lock(&deleted_wake_locks.lock);
 		deleted_wake_locks.stat.count += lock->stat.count;
 		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
 		deleted_wake_locks.stat.total_time =
@@ -382,6 +518,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 		deleted_wake_locks.stat.max_time =
 			ktime_add(deleted_wake_locks.stat.max_time,
 				  lock->stat.max_time);
+		spin_unlock(&deleted_wake_locks.lock);
 	}
 #endif
 	list_del(&lock->link);
@@ -389,22 +526,19 @@ void wake_lock_destroy(struct wake_lock *lock)
 }
 EXPORT_SYMBOL(wake_lock_destroy);
 
-static void wake_lock_internal(
-	struct wake_lock *lock, long timeout, int has_timeout)
+/*
+ * wake_lock_activate - marks 'lock' active and updates its stats, returns
+ * whether it was inactive.
+ *
+ * Caller must hold lock->lock.
+ */
+static int wake_lock_activate(struct wake_lock *lock, int type)
 {
-	int type;
-	unsigned long irqflags;
-	long expire_in;
-
-	spin_lock_irqsave(&list_lock, irqflags);
-	type = lock->flags & WAKE_LOCK_TYPE_MASK;
-	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
 #ifdef CONFIG_WAKELOCK_STAT
-	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup) {
+	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup &&
+	    xchg(&wait_for_wakeup, 0)) {
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
-		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
@@ -413,13 +547,49 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
-	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
-		lock->flags |= WAKE_LOCK_ACTIVE;
+	if (lock->flags & WAKE_LOCK_ACTIVE)
+		return 0;
+	lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+	lock->stat.last_time = ktime_get();
 #endif
+	return 1;
+}
+
+static void wake_lock_internal(
+	struct wake_lock *lock, long timeout, int has_timeout)
+{
+	int type;
+	unsigned long irqflags;
+
+	type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
+	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
+
+	/* fast path: no timeout before or after, only touch this lock */
+	if (!has_timeout) {
+		spin_lock_irqsave(&lock->lock, irqflags);
+		if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+			if (debug_mask & DEBUG_WAKE_LOCK)
+				pr_info("wake_lock: %s, type %d\n",
+					lock->name, type);
+			if (wake_lock_activate(lock, type))
+				atomic_inc(&active_count[type]);
+			lock->expires = LONG_MAX;
+			spin_unlock_irqrestore(&lock->lock, irqflags);
+			goto out;
+		}
+		spin_unlock_irqrestore(&lock->lock, irqflags);
 	}
-	list_del(&lock->link);
+
+	spin_lock_irqsave(&timeout_lock, irqflags);
+	spin_lock(&lock->lock);
+	/* take it out of the tree or count, it goes back in below */
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->node, &timeout_locks[type]);
+	else if (lock->flags & WAKE_LOCK_ACTIVE)
+		atomic_dec(&active_count[type]);
+	wake_lock_activate(lock, type);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -427,41 +597,27 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		timeout_insert_locked(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
-		list_add(&lock->link, &active_wake_locks[type]);
+		atomic_inc(&active_count[type]);
 	}
+	spin_unlock(&lock->lock);
+	if (type == WAKE_LOCK_SUSPEND && has_timeout)
+		update_expire_timer(lock, "wake_lock");
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
+
+out:
 	if (type == WAKE_LOCK_SUSPEND) {
-		current_event_num++;
+		atomic_inc(&current_event_num);
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats(1);
 #endif
-		if (has_timeout)
-			expire_in = has_wake_lock_locked(type);
-		else
-			expire_in = -1;
-		if (expire_in > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_lock: %s, start expire timer, "
-					"%ld\n", lock->name, expire_in);
-			mod_timer(&expire_timer, jiffies + expire_in);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_lock: %s, stop expire timer\n",
-						lock->name);
-			if (expire_in == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -479,41 +635,62 @@ EXPORT_SYMBOL(wake_lock_timeout);
 void wake_unlock(struct wake_lock *lock)
 {
 	int type;
+	int last = 0;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
-#ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
-#endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
-	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
-	if (type == WAKE_LOCK_SUSPEND) {
-		long has_lock = has_wake_lock_locked(type);
-		if (has_lock > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_unlock: %s, start expire timer, "
-					"%ld\n", lock->name, has_lock);
-			mod_timer(&expire_timer, jiffies + has_lock);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_unlock: %s, stop expire "
-						"timer\n", lock->name);
-			if (has_lock == 0)
-				queue_work(suspend_work_queue, &suspend_work);
+
+	spin_lock_irqsave(&lock->lock, irqflags);
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		/* fast path: only the last suspend lock looks further */
+		if (lock->flags & WAKE_LOCK_ACTIVE) {
+#ifdef CONFIG_WAKELOCK_STAT
+			wake_unlock_stat_locked(lock, 0);
+#endif
+			lock->flags &= ~WAKE_LOCK_ACTIVE;
+			last = atomic_dec_and_test(&active_count[type]);
 		}
-		if (lock == &main_wake_lock) {
-			if (debug_mask & DEBUG_SUSPEND)
-				print_active_locks(WAKE_LOCK_SUSPEND);
+		spin_unlock(&lock->lock);
+		if (!last || type != WAKE_LOCK_SUSPEND) {
+			local_irq_restore(irqflags);
+			goto out;
+		}
+		spin_lock(&timeout_lock);
+	} else {
+		spin_unlock(&lock->lock);
+		spin_lock(&timeout_lock);
+		spin_lock(&lock->lock);
+		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
+#ifdef CONFIG_WAKELOCK_STAT
+			wake_unlock_stat_locked(lock, 0);
+#endif
+			lock->flags &= ~(WAKE_LOCK_ACTIVE |
+					 WAKE_LOCK_AUTO_EXPIRE);
+			rb_erase(&lock->node, &timeout_locks[type]);
+		} else if (lock->flags & WAKE_LOCK_ACTIVE) {
+			/* it lost its timeout while we were not looking */
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+			wake_unlock_stat_locked(lock, 0);
 #endif
+			lock->flags &= ~WAKE_LOCK_ACTIVE;
+			atomic_dec(&active_count[type]);
 		}
+		spin_unlock(&lock->lock);
+	}
+	if (type == WAKE_LOCK_SUSPEND)
+		update_expire_timer(lock, "wake_unlock");
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
+
+out:
+	if (lock == &main_wake_lock) {
+		if (debug_mask & DEBUG_SUSPEND)
+			print_active_locks(WAKE_LOCK_SUSPEND);
+#ifdef CONFIG_WAKELOCK_STAT
+		update_sleep_wait_stats(0);
+#endif
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -541,8 +718,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
-		INIT_LIST_HEAD(&active_wake_locks[i]);
+	for (i = 0; i < WAKE_LOCK_TYPE_COUNT; i++) {
+		timeout_locks[i] = RB_ROOT;
+		atomic_set(&active_count[i], 0);
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,